@@ -3,9 +3,10 @@
  *
  * Firstly we need to make the /proc/sleep file busy by applying the
  * following command:
- * 	'tail -f /proc/sleep &'
+ * 	'sleep 1000 > /proc/sleep &'
  *
- * It will keep /proc/sleep open in background. In this time we will
+ * It will keep /proc/sleep open for writing in background. Readers share
+ * the file with each other, but not with a writer. In this time we will
  * run:
  * 	'./non_block /proc/sleep'
  *
@@ -1,10 +1,17 @@
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 
 #include <linux/wait.h> 	// WaitQueue
-#include <asm/uaccess.h>	// for put_user and get_user
+#include <linux/uaccess.h>	// for copy_to_user and copy_from_user
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Lucian");
@@ -19,6 +26,30 @@ MODULE_DESCRIPTION("A proc file that keeps a queue for processes"
 #define MESSAGE_LEN 100
 static char Message[MESSAGE_LEN];
 
+/*
+ * What a read of the file gives, "Last input: <Message>". It is formatted
+ * once per write by sleep_snapshot, not once per read.
+ *
+ * Snapshot and Message only change in proc_write. A writer has the file
+ * alone, so nobody reads them meanwhile.
+ *
+ */
+
+#define SNAPSHOT_PREFIX "Last input: "
+#define SNAPSHOT_LEN (sizeof(SNAPSHOT_PREFIX) + MESSAGE_LEN)
+static char Snapshot[SNAPSHOT_LEN];
+static size_t Snapshot_Len;
+
+/*
+ * Generation   - number of writes so far, it tells the readers which
+ *                follow the file that there is a new message
+ * MessageQueue - the readers waiting for the next message
+ *
+ */
+
+static u64 Generation;
+static DECLARE_WAIT_QUEUE_HEAD(MessageQueue);
+
 /*
  * Information about the proc file.
  *
@@ -35,11 +66,126 @@ static char Message[MESSAGE_LEN];
 #define PERMISSIONS    0644
 
 /*
- * Variable that keeps track if somebody is currently accessing the file.
+ * The proc file with the statistics of WaitQueue.
+ *
+ */
+
+#define STATS_FILE_NAME   "sleep_stats"
+#define STATS_PERMISSIONS 0444
+
+/*
+ * How a blocking open waits for the file. Both can be changed at runtime
+ * in /sys/module/sleep/parameters.
+ *
+ * open_timeout_ms - give up with ETIMEDOUT after this many milliseconds,
+ *                   0 waits for as long as it takes
+ * killable_open   - only a fatal signal interrupts the wait, other signals
+ *                   are handled once the file is open
+ *
+ */
+
+static unsigned int open_timeout_ms;
+module_param(open_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(open_timeout_ms, "Milliseconds an open waits for the file,"
+	" 0 waits forever");
+
+static bool killable_open;
+module_param(killable_open, bool, 0644);
+MODULE_PARM_DESC(killable_open, "Only fatal signals interrupt an open"
+	" waiting for the file");
+
+/*
+ * When follow is set, a reader which read the whole message does not get
+ * EOF: its read sleeps until a process writes a new message, and then
+ * returns the new message. Like 'tail -f', the file becomes a channel of
+ * notifications. A reader which opened the file with O_NONBLOCK gets
+ * EAGAIN instead, and can wait for the next message with poll.
  *
  */
 
-static int FileOpen;
+static bool follow;
+module_param(follow, bool, 0644);
+MODULE_PARM_DESC(follow, "Reads wait for the next message instead of"
+	" returning EOF");
+
+/*
+ * Who is currently accessing the file. A process which opened the file for
+ * writing has it alone, processes which only read share it.
+ *
+ * Writer          - a writer has the file
+ * Readers         - number of readers which have the file
+ * Writers_Waiting - number of writers in WaitQueue
+ *
+ * They are protected by the lock of WaitQueue: the queue and the owners of
+ * the file always change together, under the same lock.
+ *
+ */
+
+static bool Writer;
+static unsigned int Readers;
+static unsigned int Writers_Waiting;
+
+/*
+ * Statistics of the accesses to the file, shown in /proc/sleep_stats.
+ *
+ * Description
+ * -----------
+ *
+ * 	waiters      - processes in WaitQueue now
+ * 	peak_waiters - most processes ever in WaitQueue at the same time
+ * 	immediate    - opens which got the file without waiting
+ * 	granted      - waits which ended with the file
+ * 	rejected     - O_NONBLOCK opens (and reads taking back a place)
+ * 	               which failed with EAGAIN
+ * 	interrupted  - waits interrupted by a signal
+ * 	timed_out    - waits which gave up after open_timeout_ms
+ * 	wait_us      - log2 histogram of the waits which got the file, in
+ * 	               microseconds: slot i counts the waits shorter than
+ * 	               2^i us and at least 2^(i-1) us long
+ *
+ * The waits of the readers which follow the file and take back their
+ * place after a new message are counted too.
+ *
+ * They are protected by the lock of WaitQueue, which the open path holds
+ * anyway when it updates them.
+ *
+ */
+
+#define WAIT_SLOTS 32
+
+struct sleep_stats {
+
+	unsigned int waiters;
+	unsigned int peak_waiters;
+	u64 immediate;
+	u64 granted;
+	u64 rejected;
+	u64 interrupted;
+	u64 timed_out;
+	u64 wait_us[WAIT_SLOTS];
+
+};
+
+static struct sleep_stats Stats;
+
+/*
+ * State of an open file, kept in file->private_data.
+ *
+ * Description
+ * -----------
+ *
+ * 	generation - the message the file is reading, see Generation
+ * 	admitted   - the file counts in Writer or Readers. A reader waiting
+ * 	             for the next message gives up its place, otherwise no
+ * 	             writer could ever write that message.
+ *
+ */
+struct sleep_file {
+
+	u64 generation;
+	bool admitted;
+
+};
 
 /*
  * Queue of processes who want our proc file. This is just a macro that
@@ -49,140 +195,455 @@ static int FileOpen;
 DECLARE_WAIT_QUEUE_HEAD(WaitQueue);
 
 /*
- * File operations.
+ * A process waiting in WaitQueue.
+ *
+ * Description
+ * -----------
+ *
+ * 	wait    - the entry in WaitQueue, its private field is the process
+ * 	writer  - the process wants to write
+ * 	granted - set by sleep_grant when the process gets the file
  *
  */
+struct sleep_waiter {
 
-static int proc_open(struct inode *inode, struct file *file) {
+	struct wait_queue_entry wait;
+	bool writer;
+	bool granted;
 
-	printk(KERN_DEBUG "open operation for /proc/%s triggered\n", PROC_FILE_NAME);
+};
 
-	/*
-	 * IF the file's flags include O_NONBLOCK it means that the process does
-	 * not want to wait for the proc file. In this case if the proc file
-	 * is already open then the operation will fail with -EAGAIN.
-	 *
-	 */
+/*
+ * Can a process get the file right away? Called with the lock of WaitQueue
+ * held.
+ *
+ * A writer needs the file to be free and nobody queued before it. Readers
+ * join the readers which have the file, unless a writer is waiting: the
+ * writers are preferred, otherwise a steady flow of readers would keep
+ * them out forever.
+ *
+ */
+static bool sleep_can_enter(bool writer) {
 
-	if ((file->f_flags & O_NONBLOCK) && FileOpen) {
-		printk(KERN_DEBUG "Process rejected because it was nonblocking\n");
-		return -EAGAIN;
+	if (writer) {
+		return !Writer && !Readers && !waitqueue_active(&WaitQueue);
+	}
+
+	return !Writer && !Writers_Waiting;
+
+}
+
+static void sleep_enter(bool writer) {
+
+	if (writer) {
+		Writer = true;
+	} else {
+		Readers++;
+	}
+
+}
+
+static void sleep_grant_next(void);
+
+/*
+ * A writer left the file or gave up waiting for it, so readers which
+ * follow the file may be able to take their place back. Wake the ones
+ * polling for the next message, their poll looks again.
+ *
+ */
+static void sleep_wake_followers(void) {
+
+	wake_up_interruptible(&MessageQueue);
+
+}
+
+/*
+ * Give up the file and give it to the next processes in WaitQueue, if the
+ * file is free enough for them. Called with the lock of WaitQueue held.
+ *
+ */
+static void sleep_leave(bool writer) {
+
+	if (writer) {
+		Writer = false;
+	} else {
+		Readers--;
 	}
 
+	sleep_grant_next();
+
+	if (writer) {
+		sleep_wake_followers();
+	}
+
+}
+
+/*
+ * Give the file to a waiting process. Called with the lock of WaitQueue
+ * held, so the waiter, which lives on the stack of the process, cannot go
+ * away meanwhile.
+ *
+ * The file is handed over: the owners are updated here, and the woken
+ * process does not have to race with anybody for the file when it runs.
+ *
+ */
+static void sleep_grant(struct sleep_waiter *waiter) {
+
+	list_del_init(&waiter->wait.entry);
+
+	if (waiter->writer) {
+		Writers_Waiting--;
+	}
+
+	sleep_enter(waiter->writer);
+	waiter->granted = true;
+
+	wake_up_process(waiter->wait.private);
+
+}
+
+/*
+ * Give the file to the processes at the head of WaitQueue, as far as the
+ * current owners allow: the first waiter if it is a writer, or all the
+ * readers before the first writer. Called with the lock of WaitQueue held.
+ *
+ * Waking one writer, or exactly the readers which can enter, costs the
+ * same whatever the number of waiters behind them.
+ *
+ */
+static void sleep_grant_next(void) {
+
+	struct sleep_waiter *waiter;
+
+	while (waitqueue_active(&WaitQueue)) {
+
+		waiter = list_first_entry(&WaitQueue.head, struct sleep_waiter,
+			wait.entry);
+
+		if (Writer || (waiter->writer && Readers)) {
+			break;
+		}
+
+		sleep_grant(waiter);
+
+		if (waiter->writer) {
+			break;
+		}
+
+	}
+
+}
+
+/*
+ * Sleep in WaitQueue until sleep_grant gives the file to us. Called and
+ * returns with the lock of WaitQueue held.
+ *
+ * Arguments
+ * ---------
+ *
+ * 1. the process wants to write
+ * 2. TASK_INTERRUPTIBLE, woken by any signal, or TASK_KILLABLE, woken by
+ * fatal signals only
+ * 3. the longest wait in jiffies, MAX_SCHEDULE_TIMEOUT for no limit
+ *
+ * Return value
+ * ------------
+ *
+ * 0            - the file is ours
+ * -ERESTARTSYS - a signal arrived first, the system call is restarted or
+ *                fails with EINTR, which allows processes to be killed or
+ *                stopped
+ * -ETIMEDOUT   - the timeout expired first
+ *
+ */
+static int sleep_wait(bool writer, long state, long timeout) {
+
+	struct sleep_waiter waiter = { .writer = writer, .granted = false };
+	ktime_t start = ktime_get();
+	s64 waited_us;
+	int ret_val = 0;
+
 	/*
-	 * If the file is already open, wait until it isn't anymore.
+	 * The entry goes at the tail of the queue, so the file is given in
+	 * FIFO order.
 	 *
 	 */
 
-	while (FileOpen) {
+	init_waitqueue_entry(&waiter.wait, current);
+	__add_wait_queue_entry_tail(&WaitQueue, &waiter.wait);
+
+	if (writer) {
+		Writers_Waiting++;
+	}
+
+	Stats.waiters++;
+	Stats.peak_waiters = max(Stats.peak_waiters, Stats.waiters);
+
+	for (;;) {
 
-		int i;
-		int kill_sig = 0;
+		set_current_state(state);
 
 		/*
-		 * This function puts the current process to sleep.
-		 * Execution will be resumed right after the function call, either
-		 * because somebody called wake_up(&WaitQueue) or when a signal
-		 * is sent to the process.
-		 *
-		 * Arguments
-		 * ---------
-		 *
-		 * 1. waitqueue to wait on
-		 * 2. a condition that is checked each time the waitqueue is woken up
+		 * The grant is checked first: if the file was handed over to us
+		 * at the same time a signal or the timeout arrived, we keep the
+		 * file, otherwise nobody would wake the next waiter.
 		 *
 		 */
 
-		wait_event_interruptible(WaitQueue, !FileOpen);
+		if (waiter.granted) {
+			break;
+		}
+
+		if (signal_pending_state(state, current)) {
+			ret_val = -ERESTARTSYS;
+		} else if (!timeout) {
+			ret_val = -ETIMEDOUT;
+		}
+
+		if (ret_val) {
+			break;
+		}
+
+		spin_unlock(&WaitQueue.lock);
+		timeout = schedule_timeout(timeout);
+		spin_lock(&WaitQueue.lock);
+
+	}
+
+	__set_current_state(TASK_RUNNING);
+
+	Stats.waiters--;
+
+	switch (ret_val) {
+
+		case 0:
+			waited_us = ktime_us_delta(ktime_get(), start);
+			Stats.granted++;
+			Stats.wait_us[min(fls64(waited_us), WAIT_SLOTS - 1)]++;
+			break;
+
+		case -ERESTARTSYS:
+			Stats.interrupted++;
+			break;
+
+		case -ETIMEDOUT:
+			Stats.timed_out++;
+			break;
+
+	}
+
+	if (ret_val) {
 
 		/*
-		 * If we woke up by a signal we are not blocking the return -EINTR
-		 * (fail the system call). This allows processes to be killed or
-		 * stopped.
+		 * Leave the queue. A writer giving up may let the readers
+		 * queued behind it in.
 		 *
-		 * Explaination
-		 * ------------
-		 *
-		 * The current is a pointer to the current process. It contains a
-		 * field pending of type struct sigpending which also contains an
-		 * array of signals (current->pending.signal) denoted as
-		 * current->pending.signal.sig[i].
-		 *
-		 * current also contains a sigset_t (current->blocked) which contains
-		 * blocked signals.
+		 */
+
+		__remove_wait_queue(&WaitQueue, &waiter.wait);
+
+		if (writer) {
+			Writers_Waiting--;
+		}
+
+		sleep_grant_next();
+
+		if (writer) {
+			sleep_wake_followers();
+		}
+
+	}
+
+	return ret_val;
+
+}
+
+/*
+ * Take a place in the file for the open file, as a writer or a reader.
+ * Called with the lock of WaitQueue held, by proc_open and by a reader
+ * which follows the file and takes back its place after a message, so
+ * both obey the same rules: O_NONBLOCK, killable_open and
+ * open_timeout_ms.
+ *
+ * Returns 0, -EAGAIN or one of the errors of sleep_wait.
+ *
+ */
+static int sleep_take(struct file *file, bool writer) {
+
+	long state = killable_open ? TASK_KILLABLE : TASK_INTERRUPTIBLE;
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	int ret_val = 0;
+
+	if (open_timeout_ms) {
+		timeout = msecs_to_jiffies(open_timeout_ms);
+	}
+
+	if (sleep_can_enter(writer)) {
+
+		sleep_enter(writer);
+		Stats.immediate++;
+
+	} else if (file->f_flags & O_NONBLOCK) {
+
+		/*
+		 * IF the file's flags include O_NONBLOCK it means that the
+		 * process does not want to wait for the proc file. In this case
+		 * if the proc file cannot be opened right away then the
+		 * operation will fail with -EAGAIN.
 		 *
-		 * We must iterate through all signals in sig[i] and check that they
-		 * are nonblocked signals that can affect our process.
+		 */
+
+		printk(KERN_DEBUG "Process rejected because it was nonblocking\n");
+		Stats.rejected++;
+		ret_val = -EAGAIN;
+
+	} else {
+
+		/*
+		 * Otherwise wait until the file is given to us.
 		 *
 		 */
 
-		for (i = 0; i < _NSIG_WORDS && !kill_sig; i++) {
+		ret_val = sleep_wait(writer, state, timeout);
 
-			kill_sig = current->pending.signal.sig[i] &
-				~(current->blocked.sig[i]);
+	}
 
-		}
+	return ret_val;
 
-		if (kill_sig) {
-			return -EINTR;
-		}
+}
+
+/*
+ * File operations.
+ *
+ */
+
+/*
+ * A process which opens the file with O_RDONLY is a reader, any other
+ * open mode makes it a writer.
+ *
+ */
+
+static int proc_open(struct inode *inode, struct file *file) {
+
+	struct sleep_file *sleep_file;
+	int ret_val;
 
+	printk(KERN_DEBUG "open operation for /proc/%s triggered\n", PROC_FILE_NAME);
+
+	sleep_file = kzalloc(sizeof(*sleep_file), GFP_KERNEL);
+	if (!sleep_file) {
+		return -ENOMEM;
 	}
 
+	spin_lock(&WaitQueue.lock);
+
+	ret_val = sleep_take(file, file->f_mode & FMODE_WRITE);
+
 	/*
-	 * If we got here it means the the file is ready to be opened and FileOpen is 0.
-	 * We can now open the file
+	 * Once the file is ours no writer can change the message, the file
+	 * starts with the current one.
 	 *
 	 */
 
-	FileOpen = 1;
-	printk(KERN_DEBUG "open operation for /proc/%s was successful\n", PROC_FILE_NAME);
+	if (ret_val == 0) {
+		sleep_file->generation = Generation;
+		sleep_file->admitted = true;
+		file->private_data = sleep_file;
+	} else {
+		kfree(sleep_file);
+	}
+
+	spin_unlock(&WaitQueue.lock);
 
-	return 0;
+	switch (ret_val) {
+
+		case 0:
+			printk(KERN_DEBUG "open operation for /proc/%s was successful\n",
+				PROC_FILE_NAME);
+			break;
+
+		case -ERESTARTSYS:
+			printk(KERN_DEBUG "Process interrupted by a signal while waiting\n");
+			break;
+
+		case -ETIMEDOUT:
+			printk(KERN_DEBUG "Process gave up after %u ms\n", open_timeout_ms);
+			break;
+
+	}
+
+	return ret_val;
 }
 
 static int proc_close(struct inode *inode, struct file *file) {
 
+	struct sleep_file *sleep_file = file->private_data;
+
 	printk(KERN_DEBUG "close operation for /proc/%s triggered\n", PROC_FILE_NAME);
 
 	/*
-	 * Set FileOpen to zero, so one of the processes in WaitQueue will be
-	 * able to open the file.
+	 * Give the file to the next processes in WaitQueue, if the file is
+	 * free enough for them. A reader interrupted while it waited for a
+	 * message may not have its place anymore.
 	 *
 	 */
 
-	FileOpen = 0;
+	spin_lock(&WaitQueue.lock);
 
-	/*
-	 * Wake up the processes in WaitQueue. If any process is waiting to be
-	 * accepted, now is the moment to get accepted.
-	 *
-	 */
+	if (sleep_file->admitted) {
+		sleep_leave(file->f_mode & FMODE_WRITE);
+	}
+
+	spin_unlock(&WaitQueue.lock);
 
-	wake_up(&WaitQueue);
+	kfree(sleep_file);
 
 	printk(KERN_DEBUG "close operation for /proc/%s was successful\n", PROC_FILE_NAME);
 	return 0;
 
 }
 
+/*
+ * Format Snapshot from Message.
+ *
+ */
+static void sleep_snapshot(void) {
+
+	Snapshot_Len = scnprintf(Snapshot, SNAPSHOT_LEN, SNAPSHOT_PREFIX "%s\n",
+		Message);
+
+}
+
 static ssize_t proc_write(struct file *file, const char __user *buffer,
 	size_t length, loff_t *offset) {
 
-	int i;
-
 	printk(KERN_DEBUG "write operation for /proc/%s triggered\n", PROC_FILE_NAME);
 
 	/*
-	 * Put buffer in Message.
+	 * Put buffer in Message with a single copy, keeping room for the
+	 * terminating 0.
 	 *
 	 */
 
-	for (i = 0; i < MESSAGE_LEN - 1 && i < length; i++) {
-		get_user(*(Message + i), buffer + i);
+	if (length > MESSAGE_LEN - 1) {
+		length = MESSAGE_LEN - 1;
 	}
 
-	Message[i] = 0;
+	if (copy_from_user(Message, buffer, length)) {
+		return -EFAULT;
+	}
+
+	Message[length] = 0;
+	sleep_snapshot();
+
+	/*
+	 * Publish the new message to the readers which follow the file. They
+	 * all want it, so all of them are woken.
+	 *
+	 */
+
+	WRITE_ONCE(Generation, Generation + 1);
+	wake_up_interruptible(&MessageQueue);
 
 	/*
 	 * Return the number of written bytes.
@@ -190,48 +651,148 @@ static ssize_t proc_write(struct file *file, const char __user *buffer,
 	 */
 
 	printk(KERN_DEBUG "write operation for /proc/%s was successful\n", PROC_FILE_NAME);
-	return i;
+	return length;
+}
+
+/*
+ * Take back the place in the file a reader gave up with sleep_step_out,
+ * waiting for it like an open would.
+ *
+ */
+static int sleep_reenter(struct file *file) {
+
+	struct sleep_file *sleep_file = file->private_data;
+	int ret_val;
+
+	spin_lock(&WaitQueue.lock);
+
+	ret_val = sleep_take(file, false);
+	sleep_file->admitted = ret_val == 0;
+
+	spin_unlock(&WaitQueue.lock);
+
+	return ret_val;
+
+}
+
+/*
+ * Give up the place in the file of a reader which follows the file and
+ * has nothing left to read, so that a writer can get the file and write
+ * the next message. The next read takes the place back.
+ *
+ */
+static void sleep_step_out(struct sleep_file *sleep_file) {
+
+	spin_lock(&WaitQueue.lock);
+
+	if (sleep_file->admitted) {
+		sleep_leave(false);
+		sleep_file->admitted = false;
+	}
+
+	spin_unlock(&WaitQueue.lock);
+
+}
+
+/*
+ * Wait until a process writes a message newer than the one the reader
+ * read. Called by a reader which follows the file, with its place in the
+ * file: the place is given up while waiting, so that the writer can get
+ * the file, and taken back before returning.
+ *
+ * Returns 0, -ERESTARTSYS if a signal arrived while waiting for the
+ * message, or an error of sleep_reenter. The reader may then be left
+ * without its place, the next read takes it back.
+ *
+ */
+static int sleep_follow(struct file *file) {
+
+	struct sleep_file *sleep_file = file->private_data;
+	int ret_val;
+
+	sleep_step_out(sleep_file);
+
+	ret_val = wait_event_interruptible(MessageQueue,
+		READ_ONCE(Generation) != sleep_file->generation);
+
+	if (ret_val < 0) {
+		return ret_val;
+	}
+
+	return sleep_reenter(file);
+
 }
 
+/*
+ * *offset is the part of Snapshot this open file already read, so every
+ * process reading the file has its own position and gets the whole text,
+ * whatever the other readers do. When *offset reaches the end of Snapshot
+ * the read returns 0 to signify EOF.
+ *
+ * simple_read_from_buffer copies the requested piece with a single
+ * copy_to_user and moves *offset.
+ *
+ */
 static ssize_t proc_read(struct file *file, char __user *buffer,
 	size_t length, loff_t *offset) {
 
-
-	static int finished = 0;
-	int i;
-	char message[MESSAGE_LEN + 30];
+	struct sleep_file *sleep_file = file->private_data;
+	bool reader = !(file->f_mode & FMODE_WRITE);
+	ssize_t ret_val;
 
 	printk(KERN_DEBUG "read operation for /proc/%s triggered\n", PROC_FILE_NAME);
 
+	if (!sleep_file->admitted) {
+		ret_val = sleep_reenter(file);
+		if (ret_val < 0) {
+			return ret_val;
+		}
+	}
+
 	/*
-	 * Return 0 to signify EOF, we have nothing more to say at this
-	 * point.
+	 * A reader which follows the file and read the whole message waits
+	 * for the next one, then reads it from its beginning. A writer cannot
+	 * wait for a message, it would wait for itself.
 	 *
 	 */
 
-	if (finished) {
-		finished = 0;
+	if (READ_ONCE(follow) && reader && *offset >= Snapshot_Len) {
 
-		printk(KERN_DEBUG "There is nothing to give at the moment\n");
-		return 0;
-	}
+		if (sleep_file->generation == Generation) {
+
+			/*
+			 * A nonblocking reader does not wait, but it still has
+			 * nothing to read until a writer comes: it steps out of
+			 * the file too, otherwise the writer would never get in.
+			 *
+			 */
+
+			if (file->f_flags & O_NONBLOCK) {
+				sleep_step_out(sleep_file);
+				return -EAGAIN;
+			}
+
+			ret_val = sleep_follow(file);
+			if (ret_val < 0) {
+				return ret_val;
+			}
+
+		}
+
+		sleep_file->generation = Generation;
+		*offset = 0;
 
-	sprintf(message, "Last input: %s\n", Message);
-	for (i = 0; i < length && message[i]; i++) {
-		put_user(*(message + i), buffer + i);
 	}
 
-	/*
-	 * Set finished so that next time the process wants data from
-	 * our internal buffer it will be rejected by the first if
-	 * statement.
-	 *
-	 */
+	ret_val = simple_read_from_buffer(buffer, length, offset, Snapshot,
+		Snapshot_Len);
 
-	finished = 1;
+	if (ret_val > 0) {
+		printk(KERN_DEBUG "read operation for /proc/%s was successful\n",
+			PROC_FILE_NAME);
+	}
 
-	printk(KERN_DEBUG "read operation for /proc/%s was successful\n", PROC_FILE_NAME);
-	return i;
+	return ret_val;
 
 }
 
@@ -247,17 +808,146 @@ static struct proc_dir_entry *Proc_File;
  * File operations structure where pointers to functions like read or write
  * for our proc file lie.
  *
+ * proc files made with a struct file_operations only get .read and .write
+ * called, the proc layer does not forward .read_iter and .write_iter to us.
+ * A readv or writev is split by the kernel into one call per buffer, each
+ * served with a single copy.
+ *
  */
 
+/*
+ * Called by poll, select and epoll. The file is readable when there is
+ * something left to read: the rest of the message or, for a reader which
+ * follows the file, a newer message it can enter the file to read.
+ * MessageQueue wakes the pollers up when a message is written and when a
+ * writer leaves the file.
+ *
+ */
+static __poll_t proc_poll(struct file *file, poll_table *wait) {
+
+	struct sleep_file *sleep_file = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &MessageQueue, wait);
+
+	if (!READ_ONCE(follow) || (file->f_mode & FMODE_WRITE)) {
+
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	} else {
+
+		spin_lock(&WaitQueue.lock);
+
+		if (file->f_pos >= Snapshot_Len &&
+			sleep_file->generation == Generation) {
+
+			/*
+			 * A reader polling for the next message waits for a
+			 * writer, so it must not keep the writer out of the file
+			 * meanwhile.
+			 *
+			 */
+
+			if (sleep_file->admitted) {
+				sleep_leave(false);
+				sleep_file->admitted = false;
+			}
+
+		} else if (sleep_file->admitted || sleep_can_enter(false)) {
+
+			/*
+			 * A reader which stepped out can only read once it can
+			 * take its place back, otherwise its read would fail
+			 * with EAGAIN. sleep_wake_followers wakes it when a
+			 * writer leaves.
+			 *
+			 */
+
+			mask |= EPOLLIN | EPOLLRDNORM;
+
+		}
+
+		spin_unlock(&WaitQueue.lock);
+
+	}
+
+	if (file->f_mode & FMODE_WRITE) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+
+}
+
 static const struct file_operations Proc_File_Operations = {
 	.open = proc_open,
 	.release = proc_close,
 	.write = proc_write,
-	.read  = proc_read
+	.read  = proc_read,
+	.poll  = proc_poll
+};
+
+/*
+ * Show the statistics in /proc/sleep_stats. They are copied under the lock
+ * of WaitQueue so that they are consistent with each other, and printed
+ * after the lock is released.
+ *
+ */
+static int stats_show(struct seq_file *m, void *v) {
+
+	struct sleep_stats *stats;
+	unsigned int i;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats) {
+		return -ENOMEM;
+	}
+
+	spin_lock(&WaitQueue.lock);
+	*stats = Stats;
+	spin_unlock(&WaitQueue.lock);
+
+	seq_printf(m, "waiters      %u\n", stats->waiters);
+	seq_printf(m, "peak_waiters %u\n", stats->peak_waiters);
+	seq_printf(m, "immediate    %llu\n", stats->immediate);
+	seq_printf(m, "granted      %llu\n", stats->granted);
+	seq_printf(m, "rejected     %llu\n", stats->rejected);
+	seq_printf(m, "interrupted  %llu\n", stats->interrupted);
+	seq_printf(m, "timed_out    %llu\n", stats->timed_out);
+
+	seq_puts(m, "open wait (us):\n");
+
+	for (i = 0; i < WAIT_SLOTS; i++) {
+		if (stats->wait_us[i]) {
+			seq_printf(m, "  < %-12llu %llu\n", 1ULL << i, stats->wait_us[i]);
+		}
+	}
+
+	kfree(stats);
+
+	return 0;
+
+}
+
+static int stats_open(struct inode *inode, struct file *file) {
+
+	return single_open(file, stats_show, NULL);
+
+}
+
+static struct proc_dir_entry *Stats_File;
+
+static const struct file_operations Stats_File_Operations = {
+	.open    = stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
 };
 
 static int __init sleep_entry(void) {
 
+	sleep_snapshot();
+
 	Proc_File = proc_create(PROC_FILE_NAME, PERMISSIONS, NULL, &Proc_File_Operations);
 
 	if (!Proc_File) {
@@ -269,6 +959,18 @@ static int __init sleep_entry(void) {
 
 	}
 
+	Stats_File = proc_create(STATS_FILE_NAME, STATS_PERMISSIONS, NULL,
+		&Stats_File_Operations);
+
+	if (!Stats_File) {
+
+		proc_remove(Proc_File);
+
+		printk(KERN_ALERT "Error: Could not initialize /proc/%s\n", STATS_FILE_NAME);
+		return -ENOMEM;
+
+	}
+
 	printk(KERN_INFO "/proc/%s created\n", PROC_FILE_NAME);
 	return 0;
 
@@ -276,6 +978,7 @@ static int __init sleep_entry(void) {
 
 static void __exit sleep_exit(void) {
 
+	proc_remove(Stats_File);
 	proc_remove(Proc_File);
 	printk(KERN_INFO "/proc/%s removed\n", PROC_FILE_NAME);
 
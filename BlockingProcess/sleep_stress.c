@@ -0,0 +1,589 @@
+/*
+ * Stress test for the hand-off of /proc/sleep between processes.
+ *
+ * The program forks blocking and non-blocking openers. Each one opens the
+ * file, keeps it for a while, closes it and starts again, until it opened
+ * the file the requested number of times. At the end the program prints:
+ *
+ * 	- the number of opens per second, which for writers is the number of
+ * 	  hand-offs per second
+ * 	- the time the blocking opens waited
+ * 	- the wakeup latency: the time between the close of the previous owner
+ * 	  and the return of the open of the next one
+ * 	- the longest wait of every process, to spot starvation
+ * 	- the opens that failed with EINTR, EAGAIN and ETIMEDOUT
+ *
+ * Usage:
+ * 	./sleep_stress [-b blocking] [-n nonblocking] [-r readers]
+ * 		[-i opens] [-H hold_us] [-k signal_ms] [-S starve_ms] [-f file]
+ *
+ * 	-b  blocking writers (default 8)
+ * 	-n  non-blocking writers, they retry after EAGAIN (default 2)
+ * 	-r  blocking readers, they share the file (default 0)
+ * 	-i  opens per process (default 1000)
+ * 	-H  microseconds a process keeps the file (default 100)
+ * 	-k  send SIGUSR1 to the blocking processes every signal_ms
+ * 	    milliseconds, their waiting opens fail with EINTR (default off)
+ * 	-S  a wait longer than starve_ms milliseconds counts as starvation
+ * 	    (default 1000)
+ * 	-f  the file (default /proc/sleep)
+ *
+ * To compare with what the module saw, read /proc/sleep_stats before and
+ * after a run.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_FILE "/proc/sleep"
+#define DEFAULT_BLOCKING 8
+#define DEFAULT_NONBLOCKING 2
+#define DEFAULT_OPENS 1000
+#define DEFAULT_HOLD_US 100
+#define DEFAULT_STARVE_MS 1000
+
+/*
+ * How long a non-blocking process waits before it tries again after
+ * EAGAIN, in microseconds.
+ *
+ */
+#define RETRY_US 50
+
+enum opener {
+	BLOCKING_WRITER,
+	NONBLOCKING_WRITER,
+	BLOCKING_READER,
+};
+
+/*
+ * What a process measured, in memory shared with the parent.
+ *
+ * Description
+ * -----------
+ *
+ * 	opens     - successful opens
+ * 	eintr     - opens interrupted by a signal
+ * 	eagain    - non-blocking opens that found the file busy
+ * 	etimedout - opens that gave up after the open_timeout_ms of the module
+ * 	errors    - other failed opens
+ * 	max_wait  - longest wait of an open, in nanoseconds
+ * 	starved   - waits longer than the starvation threshold
+ * 	waits     - number of samples in the wait array of the process
+ * 	wakeups   - number of samples in the wakeup array of the process
+ *
+ */
+struct stress_child {
+
+	enum opener type;
+	long opens;
+	long eintr;
+	long eagain;
+	long etimedout;
+	long errors;
+	long long max_wait;
+	long starved;
+	long waits;
+	long wakeups;
+
+};
+
+/*
+ * Memory shared by all the processes.
+ *
+ * Description
+ * -----------
+ *
+ * 	go           - set by the parent when all the processes are ready
+ * 	last_release - time of the last close, in nanoseconds
+ *
+ */
+struct stress_shared {
+
+	int go;
+	long long last_release;
+
+};
+
+/*
+ * Parameters of the run.
+ *
+ */
+struct stress_config {
+
+	const char *file;
+	int blocking;
+	int nonblocking;
+	int readers;
+	long opens;
+	long hold_us;
+	long signal_ms;
+	long starve_ms;
+
+};
+
+static struct stress_shared *Shared;
+static struct stress_child *Children;
+
+/*
+ * Samples of every process: opens values for process i start at
+ * i * opens.
+ *
+ */
+static long long *Wait_Samples;
+static long long *Wakeup_Samples;
+
+static long long now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+}
+
+static void sleep_us(long us) {
+
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = us % 1000000 * 1000,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR) {
+		;
+	}
+
+}
+
+static void *shared_alloc(size_t size) {
+
+	void *memory;
+
+	memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (memory == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	return memory;
+
+}
+
+/*
+ * SIGUSR1 only has to interrupt the open, the handler has nothing to do.
+ * It is installed without SA_RESTART so that the open fails with EINTR
+ * instead of being restarted.
+ *
+ */
+static void on_signal(int signo) {
+
+	(void) signo;
+
+}
+
+/*
+ * Body of every process: open the file config->opens times.
+ *
+ */
+static void stress_child(const struct stress_config *config, int index) {
+
+	struct stress_child *child = &Children[index];
+	long long *waits = Wait_Samples + index * config->opens;
+	long long *wakeups = Wakeup_Samples + index * config->opens;
+	struct sigaction action;
+	long long start, end, release, wait;
+	int flags;
+	int fd;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigaction(SIGUSR1, &action, NULL);
+
+	flags = child->type == BLOCKING_READER ? O_RDONLY : O_WRONLY;
+	if (child->type == NONBLOCKING_WRITER) {
+		flags |= O_NONBLOCK;
+	}
+
+	while (!__atomic_load_n(&Shared->go, __ATOMIC_ACQUIRE)) {
+		sleep_us(100);
+	}
+
+	while (child->opens < config->opens) {
+
+		start = now_ns();
+		fd = open(config->file, flags);
+		end = now_ns();
+
+		if (fd < 0) {
+
+			switch (errno) {
+
+				case EINTR:
+					child->eintr++;
+					break;
+
+				case EAGAIN:
+					child->eagain++;
+					sleep_us(RETRY_US);
+					break;
+
+				case ETIMEDOUT:
+					child->etimedout++;
+					break;
+
+				default:
+					child->errors++;
+					perror("open");
+					exit(EXIT_FAILURE);
+
+			}
+
+			continue;
+
+		}
+
+		wait = end - start;
+		waits[child->waits++] = wait;
+
+		if (wait > child->max_wait) {
+			child->max_wait = wait;
+		}
+
+		if (wait > config->starve_ms * 1000000) {
+			child->starved++;
+		}
+
+		/*
+		 * If the previous owner closed the file while we were waiting,
+		 * the time since then is the cost of the hand-off.
+		 *
+		 */
+
+		release = __atomic_load_n(&Shared->last_release, __ATOMIC_ACQUIRE);
+		if (child->type != NONBLOCKING_WRITER && release > start) {
+			wakeups[child->wakeups++] = end - release;
+		}
+
+		child->opens++;
+
+		sleep_us(config->hold_us);
+
+		__atomic_store_n(&Shared->last_release, now_ns(), __ATOMIC_RELEASE);
+		close(fd);
+
+	}
+
+	exit(EXIT_SUCCESS);
+
+}
+
+static int compare_samples(const void *a, const void *b) {
+
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+
+}
+
+/*
+ * Merge the samples of the processes whose counter is selected by
+ * `wakeups` and print their distribution in microseconds.
+ *
+ */
+static void print_distribution(const char *name, const long long *samples,
+	const struct stress_config *config, int nr_children, int wakeups) {
+
+	long long *merged;
+	long count = 0;
+	long length;
+	int i;
+
+	merged = malloc(nr_children * config->opens * sizeof(*merged));
+	if (!merged) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nr_children; i++) {
+
+		if (Children[i].type == NONBLOCKING_WRITER) {
+			continue;
+		}
+
+		length = wakeups ? Children[i].wakeups : Children[i].waits;
+		memcpy(merged + count, samples + i * config->opens,
+			length * sizeof(*merged));
+		count += length;
+
+	}
+
+	if (count == 0) {
+		printf("%-16s no samples\n", name);
+		free(merged);
+		return;
+	}
+
+	qsort(merged, count, sizeof(*merged), compare_samples);
+
+	printf("%-16s %8ld samples  p50 %10.1f  p99 %10.1f  p999 %10.1f"
+		"  max %10.1f us\n", name, count, merged[count / 2] / 1e3,
+		merged[count * 99 / 100] / 1e3, merged[count * 999 / 1000] / 1e3,
+		merged[count - 1] / 1e3);
+
+	free(merged);
+
+}
+
+static void report(const struct stress_config *config, int nr_children,
+	double elapsed) {
+
+	long opens = 0, eintr = 0, eagain = 0, etimedout = 0, starved = 0;
+	long long min_max_wait = -1, max_max_wait = 0;
+	int i;
+
+	for (i = 0; i < nr_children; i++) {
+
+		opens += Children[i].opens;
+		eintr += Children[i].eintr;
+		eagain += Children[i].eagain;
+		etimedout += Children[i].etimedout;
+		starved += Children[i].starved;
+
+		if (Children[i].type == NONBLOCKING_WRITER) {
+			continue;
+		}
+
+		if (min_max_wait < 0 || Children[i].max_wait < min_max_wait) {
+			min_max_wait = Children[i].max_wait;
+		}
+
+		if (Children[i].max_wait > max_max_wait) {
+			max_max_wait = Children[i].max_wait;
+		}
+
+	}
+
+	printf("%d blocking writer(s), %d non-blocking writer(s), %d reader(s),"
+		" %ld opens each, %ld us hold\n", config->blocking,
+		config->nonblocking, config->readers, config->opens, config->hold_us);
+
+	printf("%ld opens in %.3f s, %.0f opens/s\n", opens, elapsed,
+		opens / elapsed);
+
+	print_distribution("open wait", Wait_Samples, config, nr_children, 0);
+	print_distribution("wakeup latency", Wakeup_Samples, config, nr_children, 1);
+
+	/*
+	 * With a fair queue every blocking process waits about as long as the
+	 * others at worst.
+	 *
+	 */
+
+	if (min_max_wait >= 0) {
+		printf("longest wait per process: from %.1f to %.1f us\n",
+			min_max_wait / 1e3, max_max_wait / 1e3);
+	}
+
+	printf("waits over %ld ms: %ld\n", config->starve_ms, starved);
+	printf("EINTR: %ld  EAGAIN: %ld  ETIMEDOUT: %ld\n", eintr, eagain,
+		etimedout);
+
+}
+
+/*
+ * Send SIGUSR1 to the blocking processes every config->signal_ms
+ * milliseconds until all the processes exited.
+ *
+ */
+static void wait_children(const struct stress_config *config, pid_t *pids,
+	int nr_children) {
+
+	int running = nr_children;
+	int status;
+	int i;
+
+	while (running) {
+
+		if (config->signal_ms) {
+
+			sleep_us(config->signal_ms * 1000);
+
+			for (i = 0; i < nr_children; i++) {
+				if (pids[i] && Children[i].type != NONBLOCKING_WRITER) {
+					kill(pids[i], SIGUSR1);
+				}
+			}
+
+		}
+
+		for (i = 0; i < nr_children; i++) {
+
+			if (!pids[i]) {
+				continue;
+			}
+
+			if (waitpid(pids[i], &status, config->signal_ms ? WNOHANG : 0) ==
+				pids[i]) {
+
+				if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+					fprintf(stderr, "process %d failed\n", i);
+				}
+
+				pids[i] = 0;
+				running--;
+
+			}
+
+		}
+
+	}
+
+}
+
+static void usage(const char *name) {
+
+	fprintf(stderr, "Usage: %s [-b blocking] [-n nonblocking] [-r readers]"
+		" [-i opens] [-H hold_us] [-k signal_ms] [-S starve_ms] [-f file]\n",
+		name);
+	exit(EXIT_FAILURE);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	struct stress_config config = {
+		.file = DEFAULT_FILE,
+		.blocking = DEFAULT_BLOCKING,
+		.nonblocking = DEFAULT_NONBLOCKING,
+		.readers = 0,
+		.opens = DEFAULT_OPENS,
+		.hold_us = DEFAULT_HOLD_US,
+		.signal_ms = 0,
+		.starve_ms = DEFAULT_STARVE_MS,
+	};
+	int nr_children;
+	pid_t *pids;
+	long long start;
+	double elapsed;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "b:n:r:i:H:k:S:f:")) != -1) {
+
+		switch (opt) {
+
+			case 'b':
+				config.blocking = atoi(optarg);
+				break;
+
+			case 'n':
+				config.nonblocking = atoi(optarg);
+				break;
+
+			case 'r':
+				config.readers = atoi(optarg);
+				break;
+
+			case 'i':
+				config.opens = atol(optarg);
+				break;
+
+			case 'H':
+				config.hold_us = atol(optarg);
+				break;
+
+			case 'k':
+				config.signal_ms = atol(optarg);
+				break;
+
+			case 'S':
+				config.starve_ms = atol(optarg);
+				break;
+
+			case 'f':
+				config.file = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+
+		}
+
+	}
+
+	nr_children = config.blocking + config.nonblocking + config.readers;
+
+	if (config.blocking < 0 || config.nonblocking < 0 || config.readers < 0 ||
+		nr_children == 0 || config.opens <= 0 || config.hold_us < 0 ||
+		config.signal_ms < 0) {
+		usage(argv[0]);
+	}
+
+	Shared = shared_alloc(sizeof(*Shared));
+	Children = shared_alloc(nr_children * sizeof(*Children));
+	Wait_Samples = shared_alloc(nr_children * config.opens *
+		sizeof(*Wait_Samples));
+	Wakeup_Samples = shared_alloc(nr_children * config.opens *
+		sizeof(*Wakeup_Samples));
+
+	pids = calloc(nr_children, sizeof(*pids));
+	if (!pids) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nr_children; i++) {
+
+		if (i < config.blocking) {
+			Children[i].type = BLOCKING_WRITER;
+		} else if (i < config.blocking + config.nonblocking) {
+			Children[i].type = NONBLOCKING_WRITER;
+		} else {
+			Children[i].type = BLOCKING_READER;
+		}
+
+		pids[i] = fork();
+
+		if (pids[i] < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pids[i] == 0) {
+			stress_child(&config, i);
+		}
+
+	}
+
+	/*
+	 * All the processes are forked, let them start together.
+	 *
+	 */
+
+	start = now_ns();
+	__atomic_store_n(&Shared->go, 1, __ATOMIC_RELEASE);
+
+	wait_children(&config, pids, nr_children);
+
+	elapsed = (now_ns() - start) / 1e9;
+
+	report(&config, nr_children, elapsed);
+
+	free(pids);
+
+	return EXIT_SUCCESS;
+
+}
@@ -1,313 +1,535 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h> 	// for put_user
+#include <linux/cdev.h>		// for struct cdev
+#include <linux/debugfs.h>	// for debugfs_create_dir and debugfs_create_file
+#include <linux/device.h>	// for class_create and device_create
+#include <linux/ktime.h>	// for ktime_get_ns
+#include <linux/log2.h>		// for roundup_pow_of_two
+#include <linux/mm.h>		// for struct vm_area_struct
+#include <linux/mutex.h>	// for struct mutex
+#include <linux/overflow.h>	// for check_add_overflow
+#include <linux/percpu.h>	// for alloc_percpu
+#include <linux/poll.h>		// for poll_wait
+#include <linux/seq_file.h>	// for seq_printf
+#include <linux/slab.h>		// for kfree
+#include <linux/string.h>	// for memdup_user
+#include <linux/uio.h>		// for struct iov_iter
+#include <linux/vmalloc.h>	// for vmalloc_user and remap_vmalloc_range
+#include <linux/uaccess.h>	// for put_user, copy_from_user and copy_to_user
 
 #include "chardev.h"
 
+#define CREATE_TRACE_POINTS
+#include "chardev_trace.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Lucian");
+MODULE_DESCRIPTION("Char devices streaming data through ring buffers, "
+	"controlled with ioctls");
+
 #define SUCCESS 0
+
+/*
+ * Processes using IOCTL_GET_MSG give us a buffer of this size, so at most
+ * BUFLEN - 1 bytes of the message (followed by a 0) are copied in it.
+ *
+ */
+
 #define BUFLEN  100
 
 /*
- * Variable used to prevent concurent acces into the same device.
+ * Limits of the ring_size module parameter.
  *
  */
 
-static int Device_Open = 0;
+#define RING_SIZE_MIN PAGE_SIZE
+#define RING_SIZE_MAX (256UL << 20)
 
 /*
- * The message the device will give when asked.
+ * Size in bytes of the ring buffer which stores the data written in the
+ * device. It is rounded up to a power of two so that a position in the
+ * stream is turned into an index in the ring with a mask.
+ *
+ * Example: `insmod chardev.ko ring_size=16777216`
  *
  */
 
-static char Message[BUFLEN];
+static unsigned long ring_size = 64 * 1024;
+module_param(ring_size, ulong, 0444);
+MODULE_PARM_DESC(ring_size, "Size in bytes of the ring buffer (default 64KiB)");
 
 /*
- * How far did the process reading the message get? It is useful if
- * Message is larger than the buffer we get to fill in device_read.
+ * Number of devices (minors) created by the module. Each of them is a
+ * separate stream with its own ring and its own writer lock, so writers
+ * on different devices never wait for each other.
+ *
+ * Example: `insmod chardev.ko nr_devices=8`
  *
  */
 
-static char *Message_Pointer;
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of char_device<N> instances (default 1)");
+
+#define NR_DEVICES_MAX 256U
 
 /*
- * This is called whenever a process attempts to open the device file.
+ * Number of ioctl commands, the statistics count them by _IOC_NR. Unknown
+ * commands are counted in the last slot.
  *
- * Functionality
- * -------------
+ */
+
+#define NR_IOCTLS (_IOC_NR(IOCTL_GET_MSG_V1) + 2)
+
+/*
+ * Latencies are kept in log2 histograms: slot i counts the operations that
+ * took between 2^(i - 1) and 2^i - 1 nanoseconds, the last slot counts
+ * everything slower.
+ *
+ */
+
+#define LATENCY_SLOTS 32
+
+/*
+ * Statistics of a device, kept per CPU so that counting never makes two
+ * CPUs fight over the same cache line. They are only added up when someone
+ * reads them from debugfs.
  *
- * In this function we need to make the device busy because we do not
- * want two processes to talk to our device at the same time. Moreover
- * we need to put our Message_Pointer at the beginnining of the message.
+ * busy          - RWF_NOWAIT writes rejected because another process was
+ * 	writing (the device does not reject opens with -EBUSY anymore)
+ * overrun_bytes - bytes readers lost because they were too slow
  *
  */
 
-static int device_open(struct inode *inode, struct file *file) {
+struct chardev_stats {
+	u64 opens;
+	u64 busy;
+	u64 reads;
+	u64 read_bytes;
+	u64 writes;
+	u64 written_bytes;
+	u64 overrun_bytes;
+	u64 ioctls[NR_IOCTLS];
+	u64 read_latency[LATENCY_SLOTS];
+	u64 write_latency[LATENCY_SLOTS];
+};
 
+/*
+ * Names of the ioctls, as printed in the statistics.
+ *
+ */
 
-	/*
-	 * Make the device busy until the operation is finished.
-	 *
-	 */
+static const char *const Ioctl_Names[NR_IOCTLS] = {
+	[_IOC_NR(IOCTL_SET_MSG)]      = "IOCTL_SET_MSG",
+	[_IOC_NR(IOCTL_GET_MSG)]      = "IOCTL_GET_MSG",
+	[_IOC_NR(IOCTL_GET_NTH_BYTE)] = "IOCTL_GET_NTH_BYTE",
+	[_IOC_NR(IOCTL_GET_RANGE)]    = "IOCTL_GET_RANGE",
+	[_IOC_NR(IOCTL_GET_RANGES)]   = "IOCTL_GET_RANGES",
+	[_IOC_NR(IOCTL_GET_MSG_V1)]   = "IOCTL_GET_MSG_V1",
+	[NR_IOCTLS - 1]               = "unknown",
+};
 
-	if (Device_Open) {
-		printk(KERN_INFO "device is busy\n");
-		return -EBUSY;
-	}
+/*
+ * Everything a device needs.
+ *
+ * cdev        - registers the minor of the device with the kernel
+ * mmap_buffer - memory allocated with vmalloc_user. Unlike a static array
+ * 	it is made of whole pages which can be mapped into user space. The
+ * 	first page keeps a struct chardev_mmap_header and the ring starts on
+ * 	the second one, as described in chardev.h.
+ * header      - header of mmap_buffer, it keeps the positions in the stream
+ * 	of data and the generation counter used to read them without any
+ * 	lock
+ * ring        - the ring buffer. The byte at position pos of the stream is
+ * 	kept in ring[pos & (ring_size - 1)] until the stream gets ring_size
+ * 	bytes further
+ * write_lock  - there is a single producer: the processes writing in the
+ * 	device take turns under this mutex. Readers do not take it, so any
+ * 	number of them can read at the same time from their own positions
+ * 	and a reader never slows down a writer. A mutex and not a spinlock
+ * 	because data is copied from user space straight into the ring while
+ * 	holding it, and copy_from_user may sleep.
+ * poll_queue  - processes sleeping in poll, select or epoll_wait on the
+ * 	device. They are woken up whenever a writer is done, because there
+ * 	is new data to read and write_lock is free again.
+ * async_queue - processes that asked for SIGIO (with fcntl F_SETOWN and
+ * 	O_ASYNC) when new data is written
+ * stats       - per CPU statistics, shown in debugfs
+ * minor       - minor number of the device
+ *
+ */
 
-	printk(KERN_INFO "device_open(%p)\n", file);
-	Device_Open = 1;
+struct chardev_device {
+	struct cdev                 cdev;
+	void                       *mmap_buffer;
+	struct chardev_mmap_header *header;
+	char                       *ring;
+	struct mutex                write_lock;
+	wait_queue_head_t           poll_queue;
+	struct fasync_struct       *async_queue;
+	struct chardev_stats __percpu *stats;
+	unsigned int                minor;
+};
 
-	/*
-	 * Intialize the message.
-	 *
-	 */
+/*
+ * The devices, the first of the device numbers allocated for them and the
+ * class used to create their files in /dev.
+ *
+ */
 
-	Message_Pointer = Message;
+static struct chardev_device *Devices;
+static dev_t First_Dev;
+static struct class *Device_Class;
+
+/*
+ * Directory /sys/kernel/debug/char_device, which holds one statistics file
+ * for every device.
+ *
+ */
+
+static struct dentry *Debug_Dir;
+
+/*
+ * Slot of the latency histograms for an operation which started at start
+ * (as returned by ktime_get_ns).
+ *
+ */
+
+static unsigned int latency_slot(u64 start) {
+
+	return min(fls64(ktime_get_ns() - start), LATENCY_SLOTS - 1);
 
-	return SUCCESS;
 }
 
 /*
- * This is called whenever a process closes the device file.
+ * Copy of the fields of the header, taken with device_read_state.
  *
  */
 
-static int device_release(struct inode *inode, struct file *file) {
+struct ring_state {
+	u64    head;
+	u64    reserved;
+	u64    message;
+	size_t length;
+};
 
-	/*
-	 * Make the device available.
-	 *
-	 */
-	printk(KERN_INFO "device released\n");
+/*
+ * Start reading the header. Wait for a writer that is in the middle of
+ * changing it and return the generation the header has.
+ *
+ */
 
-	Device_Open = 0;
+static unsigned int device_read_begin(struct chardev_device *dev) {
 
-	return SUCCESS;
+	unsigned int generation;
+
+	while ((generation = READ_ONCE(dev->header->generation)) & 1) {
+		cpu_relax();
+	}
+
+	smp_rmb();
+
+	return generation;
 
 }
 
 /*
- * This is called whenever a process which has already opened the device
- * file attempts to read from it.
- *
- * The read is from the perspective of the user.
+ * Returns true if the header changed since device_read_begin returned
+ * generation, in which case what was read must be thrown away.
  *
  */
 
-static int device_read(struct file *file, char __user *buffer, size_t length,
-	loff_t *offset) {
+static bool device_read_retry(struct chardev_device *dev,
+	unsigned int generation) {
 
-	/*
-	 * Number of written bytes in the user buffer.
-	 *
-	 */	
+	smp_rmb();
 
-	int written_bytes = 0;
+	return READ_ONCE(dev->header->generation) != generation;
 
-	printk(KERN_INFO "device_read(%p, %p, %d)\n", file, buffer, length);
+}
 
-	/*
-	 * If we are at the end of the message then return 0, which signifies
-	 * the end of file.
-	 *
-	 */
+/*
+ * Take a consistent copy of the header.
+ *
+ */
 
-	if (*Message_Pointer == 0) {
-		return 0;
-	}
+static void device_read_state(struct chardev_device *dev,
+	struct ring_state *state) {
 
-	/*
-	 * Put the data into the buffer.
-	 *
-	 */
+	unsigned int generation;
 
-	while (length && *Message_Pointer) {
+	do {
 
-		/*
-		 * Because the buffer is in user space mode we need to use
-		 * put_user function,
-		 *
-		 */
+		generation = device_read_begin(dev);
 
-		put_user(*(Message_Pointer++), buffer++);
+		state->head     = dev->header->head;
+		state->reserved = dev->header->reserved;
+		state->message  = dev->header->message;
+		state->length   = dev->header->length;
 
-		length--;
-		written_bytes++;
+	} while (device_read_retry(dev, generation));
 
-	}
+}
 
-	printk(KERN_INFO "Read %d bytes, %d left\n", written_bytes, length);
+/*
+ * Position of the oldest byte of the stream that is still in the ring, the
+ * bytes before it were (or are being) overwritten.
+ *
+ */
 
-	/*
-	 * Return the number of bytes inserted in the buffer.
-	 *
-	 */
+static u64 ring_oldest(const struct ring_state *state) {
 
-	return written_bytes;
+	return state->reserved > ring_size ? state->reserved - ring_size : 0;
 
 }
 
 /*
- * This function is called whenever someone tries to write to our device.
+ * Start changing the header. Only called with write_lock held.
  *
- * The write is from the perspective of the user.
+ * The generation is odd while the header is changed, which tells readers,
+ * in the kernel or in user space, to wait and read again.
  *
  */
 
-static ssize_t device_write(struct file *file, const char __user *buffer, 
-	size_t length, loff_t *offset) {
+static void device_write_begin(struct chardev_device *dev) {
 
-	int i;
+	WRITE_ONCE(dev->header->generation, dev->header->generation + 1);
+	smp_wmb();
 
-	printk(KERN_INFO "device_write(%p, %p, %d)\n", file, buffer, length);
+}
 
-	/*
-	 * Take byte by byte the message from buffer.
-	 *
-	 */
+static void device_write_end(struct chardev_device *dev) {
+
+	smp_wmb();
+	WRITE_ONCE(dev->header->generation, dev->header->generation + 1);
+
+}
+
+/*
+ * Copy length bytes of the stream, starting at position pos, to the
+ * iov_iter, which describes one or more user space buffers. The copy is
+ * made in at most two pieces, the second one when the data wraps around
+ * the end of the ring.
+ *
+ * Returns -EAGAIN if a writer overwrote the data while it was copied, in
+ * which case the iov_iter is reverted and the caller must look at the
+ * header again.
+ *
+ */
 
-	for (i = 0; i < length && i < BUFLEN; i++) {
+static int ring_copy_to_iter(struct chardev_device *dev, struct iov_iter *to,
+	u64 pos, size_t length) {
 
-		get_user(Message[i], buffer + i);
+	struct ring_state state;
+	size_t index = pos & (ring_size - 1);
+	size_t first = min_t(size_t, length, ring_size - index);
+	size_t copied;
 
+	copied = copy_to_iter(dev->ring + index, first, to);
+	if (copied == first) {
+		copied += copy_to_iter(dev->ring, length - first, to);
 	}
 
-	Message_Pointer = Message;
+	if (copied != length) {
+		iov_iter_revert(to, copied);
+		return -EFAULT;
+	}
 
 	/*
-	 * Return the number of characters written in our internal buffer.
+	 * A writer makes room for new data by moving reserved forward before
+	 * overwriting anything, so if pos is still inside the ring now, the
+	 * copy was not disturbed.
 	 *
 	 */
 
-	return i;
+	smp_rmb();
+	device_read_state(dev, &state);
+
+	if (pos < ring_oldest(&state)) {
+		iov_iter_revert(to, copied);
+		return -EAGAIN;
+	}
+
+	return SUCCESS;
 
 }
 
 /*
- * This function is called whenever a process tries to do an ioctl on our
- * device file. 
+ * Append the data described by the iov_iter to the stream as a new
+ * message. All the buffers of a writev end up in the same message.
+ * Messages longer than the ring are cut to ring_size bytes.
  *
- * Arguments
- * ---------
- *
- * 1. struct inode holds data about a file or a directory on disk
- * 2. struct file holds data about an open file/socket etc
- * 3. the ioctl number
- * 4. the parameter given to the ioctl function, it's strange that it is a
- * 	unsigned long and not a void *
+ * If nowait is set and another process is writing, give up with -EAGAIN
+ * instead of sleeping on write_lock.
  *
- * More info about the first two structures can be found at:
- * http://books.gigatux.nl/mirror/kerneldevelopment/0672327201/ch12lev1sec6.html
- * https://www.tldp.org/LDP/tlk/ds/ds.html
+ * Returns the number of bytes appended.
  *
  */
 
-long device_ioctl(struct file *file, unsigned int ioctl_num,
-	unsigned long ioctl_param) {
+static ssize_t ring_append(struct chardev_device *dev, struct iov_iter *from,
+	bool nowait) {
+
+	u64 pos;
+	size_t length, index, first;
+	ssize_t ret_val;
+
+	length = min_t(size_t, iov_iter_count(from), ring_size);
+
+	if (nowait) {
+		if (!mutex_trylock(&dev->write_lock)) {
+			this_cpu_inc(dev->stats->busy);
+			return -EAGAIN;
+		}
+	} else {
+		mutex_lock(&dev->write_lock);
+	}
+
+	pos   = dev->header->head;
+	index = pos & (ring_size - 1);
+	first = min_t(size_t, length, ring_size - index);
 
 	/*
-	 * Description
-	 * -----------
+	 * Tell readers which bytes are going to be overwritten before
+	 * touching them.
 	 *
-	 * i    - used for interating in IOCTL_SET_MSG (it will contain the
-	 * 	length of the message contained in *ioctl_param at the end
-	 * 	of the iteration)
-	 *
-	 * ch   - it is used to read the ioctl_param one byte at a time
-	 *
-	 * temp - char pointer to ioctl_param used for receiving the message
-	 * 	from user space
-	 *
-	 * 	(see IOCTL_SET_MSG for more info)
+	 */
+
+	device_write_begin(dev);
+	dev->header->reserved = pos + length;
+	device_write_end(dev);
+
+	smp_wmb();
+
+	/*
+	 * Take the data from the user buffers with a single copy (two when it
+	 * wraps around the end of the ring).
 	 *
 	 */
-	 
 
-	int i;
-	char ch;
-	char *temp;
+	if (copy_from_iter(dev->ring + index, first, from) != first ||
+		copy_from_iter(dev->ring, length - first, from) != length - first) {
+
+		/*
+		 * The bytes in the reserved space are garbage now. Publish them
+		 * anyway so the stream stays contiguous, but leave an empty
+		 * message behind them since the old one may be overwritten.
+		 *
+		 */
+
+		ret_val = -EFAULT;
+
+		device_write_begin(dev);
+		dev->header->head    = pos + length;
+		dev->header->message = pos + length;
+		dev->header->length  = 0;
+		device_write_end(dev);
+
+		goto out;
+
+	}
 
 	/*
-	 * Switch structure according to the ioctl called.
+	 * Make the data visible to readers.
 	 *
 	 */
 
-	switch (ioctl_num) {
+	device_write_begin(dev);
+	dev->header->head    = pos + length;
+	dev->header->message = pos;
+	dev->header->length  = length;
+	device_write_end(dev);
 
-		case IOCTL_SET_MSG:
+	ret_val = length;
 
-			/*
-			 * Receive a pointer to a message from user space and set
-			 * that to be the device's message. Get the parameter
-			 * give to ioctl by the process.
-			 *
-			 */
+	kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
 
-			temp = (char *) ioctl_param;
+out:
+	mutex_unlock(&dev->write_lock);
 
-			/*
-			 * Find the length of the message by reading bytes from
-			 * temp until a 0 byte is encountered.
-			 *
-			 */
+	wake_up_interruptible(&dev->poll_queue);
 
-			get_user(ch, temp);
-			for (i = 0; ch && i < BUFLEN; i++, temp++) {
-				get_user(ch, temp);
-			}
+	return ret_val;
 
-			/*
-			 * Write the message from ioctl_param in our internal
-			 * message.
-			 *
-			 */
+}
 
-			device_write(file, (char *) ioctl_param, i, 0);
+/*
+ * Number of bytes of range that are inside the message.
+ *
+ */
 
-			break;
+static size_t range_length(const struct ring_state *state,
+	const struct chardev_range *range) {
 
-		case IOCTL_GET_MSG:
+	if (range->offset >= state->length) {
+		return 0;
+	}
 
-			/*
-			 * Give the internal message to the calling process.
-			 * The parameter we will be receiving is a pointer that
-			 * must be filled with bytes from our message.
-			 *
-			 */
+	return min_t(u64, range->length, state->length - range->offset);
 
-			i = device_read(file, (char *) ioctl_param, BUFLEN - 1, 0);
+}
 
-			/*
-			 * Put a 0 at the end of the buffer.
-			 *
-			 */
+/*
+ * Copy the slices of the latest message described by ranges to user space
+ * and update the length of every range with the number of bytes copied.
+ *
+ * All the slices come from the same message: if a writer overwrites it
+ * in the middle, start again with the newer one.
+ *
+ * A range whose end does not fit in 64 bits is refused with -EINVAL
+ * before anything is copied. Ranges outside the message copy nothing and
+ * are skipped, so that a huge offset is never added to the position of
+ * the message.
+ *
+ */
 
-			put_user(0, (char *) ioctl_param + i);
+static int device_get_ranges(struct chardev_device *dev,
+	struct chardev_range *ranges, size_t count) {
 
-			break;
+	struct ring_state state;
+	struct iovec iov;
+	struct iov_iter iter;
+	size_t i, length;
+	u64 end;
+	int ret_val;
 
-		case IOCTL_GET_NTH_BYTE:
-			
-			/*
-			 * Now ioctl_param must be interpreted as an integer used
-			 * to index in Message.
-			 *
-			 */
+	for (i = 0; i < count; i++) {
+		if (check_add_overflow(ranges[i].offset, ranges[i].length, &end)) {
+			return -EINVAL;
+		}
+	}
 
-			/*
-			 * Boundary check.
-			 *
-			 */
+	do {
 
-			if (ioctl_param > BUFLEN - 1 || ioctl_param < 0) {
-				return -EINVAL;
+		device_read_state(dev, &state);
+
+		for (i = 0, ret_val = SUCCESS; i < count && !ret_val; i++) {
+
+			length = range_length(&state, &ranges[i]);
+
+			if (length == 0) {
+				continue;
 			}
 
-			return Message[ioctl_param];
-			
-			break;
+			ret_val = import_single_range(READ,
+				u64_to_user_ptr(ranges[i].buffer), length, &iov, &iter);
+
+			if (!ret_val) {
+				ret_val = ring_copy_to_iter(dev, &iter,
+					state.message + ranges[i].offset, length);
+			}
+
+		}
 
+	} while (ret_val == -EAGAIN);
+
+	if (ret_val < 0) {
+		return ret_val;
+	}
+
+	for (i = 0; i < count; i++) {
+		ranges[i].length = range_length(&state, &ranges[i]);
 	}
 
 	return SUCCESS;
@@ -315,79 +537,936 @@ long device_ioctl(struct file *file, unsigned int ioctl_num,
 }
 
 /*
- * This structure will hold the functions to be called when a process
- * does something to the device we created. Since a pointer to this
- * structure is kept in the devices table, it cannot be local to
- * this module. It is automatically filled with NULL for unimplemented
- * functionalities.
+ * This is called whenever a process attempts to open the device file.
  *
- * To see the signature of the functions needed to fill the fields in
- * this structure, please see:
- * https://www.tldp.org/LDP/lkmpg/2.4/html/c577.htm
+ * Functionality
+ * -------------
  *
- * From my understanding this signatures are deprecated since 2.4.2 because
- * the file_operations structure no longer uses a ioctl field. ioctl is
- * one of the remaining parts of the kernel which runs under 
- * Big Kernel Lock.
+ * Any number of processes can have the device open at the same time. The
+ * position of the process in the stream is kept by the kernel in
+ * file->f_pos. A newly opened file starts with the oldest data which is
+ * still in the ring.
  *
- * In newer versions of kernel the unlocked_ioctl is used to increase
- * performance.
+ * The inode of the device file points to the struct cdev of the device,
+ * which is inside its struct chardev_device. Keep a pointer to it in
+ * file->private_data for the other file operations.
  *
- * See this link for more details:
- * https://unix.stackexchange.com/questions/4711/what-is-the-difference-between-ioctl-unlocked-ioctl-and-compat-ioctl
+ * FMODE_NOWAIT tells the kernel that the file supports RWF_NOWAIT (and
+ * io_uring's non blocking attempts): reads never sleep and writes give up
+ * instead of waiting for another writer.
  *
  */
 
-struct file_operations Fops = {
-	.open    = device_open,
-	.release = device_release,
-	.read    = device_read,
-	.write   = device_write,
-	.unlocked_ioctl   = device_ioctl
-};
-
-int init_module() {
-
-	int ret_val;
-
-	/*
-	 * We no longer use 0 as the first argument as we did in the last 
-	 * lessons because now we want to tell the kernel to register the
-	 * device with the major number CHRDEV_MAJOR.
-	 *
-	 */
+static int device_open(struct inode *inode, struct file *file) {
 
-	ret_val = register_chrdev(CHRDEV_MAJOR, DEVICE_NAME, &Fops);
+	struct chardev_device *dev;
+	struct ring_state state;
 
-	if (ret_val < 0) {
-		printk(KERN_ALERT "Error: register_chdrev: %d\n", ret_val);
-		return ret_val;
-	}
+	dev = container_of(inode->i_cdev, struct chardev_device, cdev);
+	file->private_data = dev;
 
-	printk(KERN_INFO "Successfully registered device with the major number %d\n",
-		CHRDEV_MAJOR);
+	this_cpu_inc(dev->stats->opens);
+	trace_chardev_open(dev->minor, file);
 
-	printk(KERN_INFO "If you want to talk to the device driver you have to"
-		" create a device file. Use the following command: \n"
-		"`mknod %s c %d 0`\n", DEVICE_NAME, CHRDEV_MAJOR);
+	device_read_state(dev, &state);
+	file->f_pos = ring_oldest(&state);
+	file->f_mode |= FMODE_NOWAIT;
 
 	return SUCCESS;
-
 }
 
-void cleanup_module() {
+/*
+ * This is called whenever a process turns O_ASYNC on or off for the device
+ * file. fasync_helper adds or removes the file from async_queue.
+ *
+ */
+
+static int device_fasync(int fd, struct file *file, int on) {
+
+	struct chardev_device *dev = file->private_data;
+
+	return fasync_helper(fd, file, on, &dev->async_queue);
+
+}
+
+/*
+ * This is called whenever a process closes the device file.
+ *
+ */
+
+static int device_release(struct inode *inode, struct file *file) {
+
+	struct chardev_device *dev = file->private_data;
+
+	trace_chardev_release(dev->minor, file);
+
+	/*
+	 * Stop sending SIGIO for this file.
+	 *
+	 */
+
+	device_fasync(-1, file, 0);
+
+	return SUCCESS;
+
+}
+
+/*
+ * This is called whenever a process which has already opened the device
+ * file attempts to read from it.
+ *
+ * The read is from the perspective of the user.
+ *
+ * It is called through read_iter, so read, readv, preadv2, io_uring and
+ * splice all end up here. The user space buffers are described by the
+ * iov_iter and filled with as few copies as possible.
+ *
+ * iocb->ki_pos is the position in the stream the process got to. If the
+ * process is so slow that writers went more than ring_size bytes ahead of
+ * it, the data it missed is lost and it continues with the oldest data in
+ * the ring.
+ *
+ * The work is done by ring_read, device_read_iter only keeps the
+ * statistics and fires the tracepoint.
+ *
+ */
+
+static ssize_t ring_read(struct chardev_device *dev, struct kiocb *iocb,
+	struct iov_iter *to) {
+
+	struct ring_state state;
+	u64 pos;
+	size_t available;
+	int ret_val;
+
+	do {
+
+		device_read_state(dev, &state);
+
+		pos = max_t(u64, iocb->ki_pos, ring_oldest(&state));
+
+		/*
+		 * If we are at the end of the stream then return 0, which
+		 * signifies the end of file.
+		 *
+		 */
+
+		if (pos >= state.head) {
+			return 0;
+		}
+
+		available = min_t(u64, state.head - pos, iov_iter_count(to));
+
+		/*
+		 * Put the data into the buffers. Because the buffers are in user
+		 * space we cannot simply dereference them, but instead of moving
+		 * one byte at a time with put_user we hand whole chunks to
+		 * copy_to_iter.
+		 *
+		 */
+
+		ret_val = ring_copy_to_iter(dev, to, pos, available);
+
+	} while (ret_val == -EAGAIN);
+
+	if (ret_val < 0) {
+		return ret_val;
+	}
+
+	if (pos > iocb->ki_pos) {
+		this_cpu_add(dev->stats->overrun_bytes, pos - iocb->ki_pos);
+	}
+
+	iocb->ki_pos = pos + available;
+
+	/*
+	 * Return the number of bytes inserted in the buffer.
+	 *
+	 */
+
+	return available;
+
+}
+
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+	struct chardev_device *dev = iocb->ki_filp->private_data;
+	loff_t pos = iocb->ki_pos;
+	size_t length = iov_iter_count(to);
+	u64 start = ktime_get_ns();
+	ssize_t ret_val;
+
+	ret_val = ring_read(dev, iocb, to);
+
+	this_cpu_inc(dev->stats->reads);
+	this_cpu_inc(dev->stats->read_latency[latency_slot(start)]);
+
+	if (ret_val > 0) {
+		this_cpu_add(dev->stats->read_bytes, ret_val);
+	}
+
+	trace_chardev_read(dev->minor, pos, length, ret_val);
+
+	return ret_val;
+
+}
+
+/*
+ * This function is called whenever someone tries to write to our device.
+ *
+ * The write is from the perspective of the user.
+ *
+ * The data is appended to the stream, so the device acts as a pipe which
+ * any number of readers can follow. As for reading, write, writev,
+ * pwritev2, io_uring and splice all end up here.
+ *
+ */
+
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+	struct chardev_device *dev = iocb->ki_filp->private_data;
+	size_t length = iov_iter_count(from);
+	u64 start = ktime_get_ns();
+	ssize_t ret_val;
+
+	ret_val = ring_append(dev, from, iocb->ki_flags & IOCB_NOWAIT);
+
+	this_cpu_inc(dev->stats->writes);
+	this_cpu_inc(dev->stats->write_latency[latency_slot(start)]);
+
+	if (ret_val > 0) {
+		this_cpu_add(dev->stats->written_bytes, ret_val);
+	}
+
+	trace_chardev_write(dev->minor, iocb->ki_pos, length, ret_val);
+
+	/*
+	 * Return the number of characters written in our internal buffer.
+	 *
+	 */
+
+	return ret_val;
+
+}
+
+/*
+ * This function is called whenever a process tries to do an ioctl on our
+ * device file.
+ *
+ * Arguments
+ * ---------
+ *
+ * 1. struct inode holds data about a file or a directory on disk
+ * 2. struct file holds data about an open file/socket etc
+ * 3. the ioctl number
+ * 4. the parameter given to the ioctl function, it's strange that it is a
+ * 	unsigned long and not a void *
+ *
+ * More info about the first two structures can be found at:
+ * http://books.gigatux.nl/mirror/kerneldevelopment/0672327201/ch12lev1sec6.html
+ * https://www.tldp.org/LDP/tlk/ds/ds.html
+ *
+ * The message the ioctls talk about is the data given by the last write,
+ * or by the last IOCTL_SET_MSG.
+ *
+ * The ioctls are handled by device_do_ioctl, device_ioctl only keeps the
+ * statistics and fires the tracepoint.
+ *
+ */
+
+static long device_do_ioctl(struct file *file, unsigned int ioctl_num,
+	unsigned long ioctl_param) {
+
+	/*
+	 * Description
+	 * -----------
+	 *
+	 * length  - length of the message received in IOCTL_SET_MSG, as
+	 * 	returned by strnlen_user, or copied in IOCTL_GET_MSG
+	 *
+	 * state   - copy of the header, used to find the message
+	 *
+	 * ret_val - result of copying the message in or out of the ring
+	 *
+	 * iov, iter - describe the user space buffer given in ioctl_param,
+	 * 	so the ring can be accessed the same way as in read and write
+	 *
+	 * range, ranges, request - slices asked for in IOCTL_GET_RANGE and
+	 * 	IOCTL_GET_RANGES
+	 *
+	 * msg     - argument of IOCTL_GET_MSG_V1
+	 *
+	 * dev     - the device the file belongs to
+	 *
+	 */
+
+	struct chardev_device *dev = file->private_data;
+	long length;
+	struct ring_state state;
+	ssize_t ret_val;
+	struct iovec iov;
+	struct iov_iter iter;
+	struct chardev_range range;
+	struct chardev_range *ranges;
+	struct chardev_ranges request;
+	struct chardev_msg msg;
+	char ch;
+
+	/*
+	 * Switch structure according to the ioctl called.
+	 *
+	 */
+
+	switch (ioctl_num) {
+
+		case IOCTL_SET_MSG:
+
+			/*
+			 * Receive a pointer to a message from user space and set
+			 * that to be the device's message. Get the parameter
+			 * give to ioctl by the process.
+			 *
+			 * strnlen_user finds the length of the string (including
+			 * its 0 byte) without copying it, then the message goes
+			 * to the ring with a single copy, the same way as a write.
+			 *
+			 */
+
+			length = strnlen_user((const char __user *) ioctl_param,
+				ring_size + 1);
+
+			if (length == 0) {
+				return -EFAULT;
+			}
+
+			ret_val = import_single_range(WRITE, (char __user *) ioctl_param,
+				min_t(size_t, length - 1, ring_size), &iov, &iter);
+
+			if (ret_val < 0) {
+				return ret_val;
+			}
+
+			ret_val = ring_append(dev, &iter, false);
+
+			if (ret_val < 0) {
+				return ret_val;
+			}
+
+			break;
+
+		case IOCTL_GET_MSG:
+
+			/*
+			 * Give the internal message to the calling process.
+			 * The parameter we will be receiving is a pointer that
+			 * must be filled with bytes from our message, followed by
+			 * a 0.
+			 *
+			 * If a writer overwrote the message while it was copied,
+			 * give the newer one instead.
+			 *
+			 */
+
+			do {
+
+				device_read_state(dev, &state);
+				length = min_t(size_t, state.length, BUFLEN - 1);
+
+				ret_val = import_single_range(READ,
+					(char __user *) ioctl_param, length, &iov, &iter);
+
+				if (ret_val < 0) {
+					return ret_val;
+				}
+
+				ret_val = ring_copy_to_iter(dev, &iter, state.message, length);
+
+			} while (ret_val == -EAGAIN);
+
+			if (ret_val < 0) {
+				return ret_val;
+			}
+
+			if (put_user(0, (char __user *) ioctl_param + length)) {
+				return -EFAULT;
+			}
+
+			break;
+
+		case IOCTL_GET_NTH_BYTE:
+
+			/*
+			 * Now ioctl_param must be interpreted as an integer used
+			 * to index in the message. The message is followed by 0s.
+			 *
+			 */
+
+			/*
+			 * Boundary check.
+			 *
+			 */
+
+			if (ioctl_param > ring_size - 1) {
+				return -EINVAL;
+			}
+
+			do {
+
+				device_read_state(dev, &state);
+
+				if (ioctl_param >= state.length) {
+					return 0;
+				}
+
+				ch = dev->ring[(state.message + ioctl_param) & (ring_size - 1)];
+
+				smp_rmb();
+				device_read_state(dev, &state);
+
+			} while (state.message + ioctl_param < ring_oldest(&state));
+
+			return ch;
+
+			break;
+
+		case IOCTL_GET_RANGE:
+
+			/*
+			 * ioctl_param points to a struct chardev_range. Copy the
+			 * slice and give back the structure with the number of
+			 * copied bytes.
+			 *
+			 */
+
+			if (copy_from_user(&range, (void __user *) ioctl_param,
+				sizeof(range))) {
+				return -EFAULT;
+			}
+
+			ret_val = device_get_ranges(dev, &range, 1);
+
+			if (ret_val < 0) {
+				return ret_val;
+			}
+
+			if (copy_to_user((void __user *) ioctl_param, &range,
+				sizeof(range))) {
+				return -EFAULT;
+			}
+
+			break;
+
+		case IOCTL_GET_RANGES:
+
+			/*
+			 * ioctl_param points to a struct chardev_ranges which
+			 * points to the array of slices. The whole array is
+			 * copied in and out at once.
+			 *
+			 */
+
+			if (copy_from_user(&request, (void __user *) ioctl_param,
+				sizeof(request))) {
+				return -EFAULT;
+			}
+
+			if (request.count == 0 || request.count > CHARDEV_MAX_RANGES) {
+				return -EINVAL;
+			}
+
+			ranges = memdup_user(u64_to_user_ptr(request.ranges),
+				request.count * sizeof(*ranges));
+
+			if (IS_ERR(ranges)) {
+				return PTR_ERR(ranges);
+			}
+
+			ret_val = device_get_ranges(dev, ranges, request.count);
+
+			if (!ret_val && copy_to_user(u64_to_user_ptr(request.ranges),
+				ranges, request.count * sizeof(*ranges))) {
+				ret_val = -EFAULT;
+			}
+
+			kfree(ranges);
+
+			if (ret_val < 0) {
+				return ret_val;
+			}
+
+			break;
+
+		case IOCTL_GET_MSG_V1:
+
+			/*
+			 * Same as IOCTL_GET_MSG, but the process tells us how
+			 * big its buffer is and we tell it how long the message
+			 * is.
+			 *
+			 */
+
+			if (copy_from_user(&msg, (void __user *) ioctl_param,
+				sizeof(msg))) {
+				return -EFAULT;
+			}
+
+			if (msg.version != CHARDEV_MSG_VERSION || msg.flags) {
+				return -EINVAL;
+			}
+
+			do {
+
+				device_read_state(dev, &state);
+				length = min_t(u64, state.length, msg.capacity);
+
+				ret_val = import_single_range(READ,
+					u64_to_user_ptr(msg.buffer), length, &iov, &iter);
+
+				if (ret_val < 0) {
+					return ret_val;
+				}
+
+				ret_val = ring_copy_to_iter(dev, &iter, state.message, length);
+
+			} while (ret_val == -EAGAIN);
+
+			if (ret_val < 0) {
+				return ret_val;
+			}
+
+			msg.length = state.length;
+
+			if (copy_to_user((void __user *) ioctl_param, &msg,
+				sizeof(msg))) {
+				return -EFAULT;
+			}
+
+			break;
+
+	}
+
+	return SUCCESS;
+
+}
+
+long device_ioctl(struct file *file, unsigned int ioctl_num,
+	unsigned long ioctl_param) {
+
+	struct chardev_device *dev = file->private_data;
+	unsigned int slot = _IOC_NR(ioctl_num);
+	long ret_val;
+
+	ret_val = device_do_ioctl(file, ioctl_num, ioctl_param);
+
+	if (_IOC_TYPE(ioctl_num) != CHRDEV_IOC_MAGIC || slot >= NR_IOCTLS - 1) {
+		slot = NR_IOCTLS - 1;
+	}
+
+	this_cpu_inc(dev->stats->ioctls[slot]);
+	trace_chardev_ioctl(dev->minor, ioctl_num, ret_val);
+
+	return ret_val;
+
+}
+
+/*
+ * This function is called whenever a process uses poll, select or epoll
+ * on the device file.
+ *
+ * poll_wait adds the poll_queue of the device to the queues the process
+ * sleeps on, then we say what can be done right now:
+ *
+ * EPOLLIN  - writers went past the position of this file in the stream
+ * EPOLLOUT - no other process is writing, so a write does not wait for
+ * 	write_lock. The ring never fills up, the oldest data is overwritten.
+ *
+ */
+
+static __poll_t device_poll(struct file *file, poll_table *wait) {
+
+	struct chardev_device *dev = file->private_data;
+	struct ring_state state;
+	__poll_t mask = 0;
+
+	poll_wait(file, &dev->poll_queue, wait);
+
+	device_read_state(dev, &state);
+
+	if (file->f_pos < state.head) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (!mutex_is_locked(&dev->write_lock)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+
+}
+
+/*
+ * This function is called whenever a process maps the device file in its
+ * memory with mmap.
+ *
+ * The process gets the header page followed by the pages of the ring, so
+ * it can read the data without any system call. The mapping is read only,
+ * only the module changes the data.
+ *
+ */
+
+static int device_mmap(struct file *file, struct vm_area_struct *vma) {
+
+	struct chardev_device *dev = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
 
 	/*
-	 * Unregister the device. Keep in mind that since 2.6.12 unregister_chrdev
-	 * does not return a value anymore becuase it was reported that it always
-	 * returned 0 making it meaningless.
+	 * Do not allow the mapping to become writable later with mprotect.
 	 *
-	 * See:
-	 * https://stackoverflow.com/questions/3237384/how-to-find-if-unregister-chrdev-call-was-successful
+	 */
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/*
+	 * remap_vmalloc_range checks that the mapping fits in mmap_buffer and
+	 * maps its pages starting with the page at vma->vm_pgoff.
 	 *
 	 */
 
-	unregister_chrdev(CHRDEV_MAJOR, DEVICE_NAME);
+	return remap_vmalloc_range(vma, dev->mmap_buffer, vma->vm_pgoff);
+
+}
+
+/*
+ * This structure will hold the functions to be called when a process
+ * does something to the device we created. Since a pointer to this
+ * structure is kept in the devices table, it cannot be local to
+ * this module. It is automatically filled with NULL for unimplemented
+ * functionalities.
+ *
+ * To see the signature of the functions needed to fill the fields in
+ * this structure, please see:
+ * https://www.tldp.org/LDP/lkmpg/2.4/html/c577.htm
+ *
+ * From my understanding this signatures are deprecated since 2.4.2 because
+ * the file_operations structure no longer uses a ioctl field. ioctl is
+ * one of the remaining parts of the kernel which runs under
+ * Big Kernel Lock.
+ *
+ * In newer versions of kernel the unlocked_ioctl is used to increase
+ * performance.
+ *
+ * See this link for more details:
+ * https://unix.stackexchange.com/questions/4711/what-is-the-difference-between-ioctl-unlocked-ioctl-and-compat-ioctl
+ *
+ * read_iter and write_iter replace read and write: the kernel turns a plain
+ * read or write into a single buffer iov_iter. splice_read and splice_write
+ * are the generic helpers built on top of them.
+ *
+ */
+
+struct file_operations Fops = {
+	.owner        = THIS_MODULE,
+	.open         = device_open,
+	.release      = device_release,
+	.read_iter    = device_read_iter,
+	.write_iter   = device_write_iter,
+	.splice_read  = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.poll         = device_poll,
+	.fasync       = device_fasync,
+	.mmap         = device_mmap,
+	.unlocked_ioctl   = device_ioctl
+};
+
+/*
+ * Print a latency histogram, skipping the empty slots.
+ *
+ */
+
+static void stats_show_latency(struct seq_file *m, const char *name,
+	const u64 *histogram) {
+
+	unsigned int i;
+
+	seq_printf(m, "%s latency (ns):\n", name);
+
+	for (i = 0; i < LATENCY_SLOTS; i++) {
+		if (histogram[i]) {
+			seq_printf(m, "  < %-12llu %llu\n", 1ULL << i, histogram[i]);
+		}
+	}
+
+}
+
+/*
+ * Show the statistics of a device in
+ * /sys/kernel/debug/char_device/char_device<N>.
+ *
+ * The counters of all the CPUs are added up here, so reading the file is
+ * slow but counting is fast.
+ *
+ */
+
+static int stats_show(struct seq_file *m, void *v) {
+
+	struct chardev_device *dev = m->private;
+	struct chardev_stats *sum;
+	struct chardev_stats *cpu_stats;
+	unsigned int i;
+	int cpu;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum) {
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+
+		cpu_stats = per_cpu_ptr(dev->stats, cpu);
+
+		sum->opens         += cpu_stats->opens;
+		sum->busy          += cpu_stats->busy;
+		sum->reads         += cpu_stats->reads;
+		sum->read_bytes    += cpu_stats->read_bytes;
+		sum->writes        += cpu_stats->writes;
+		sum->written_bytes += cpu_stats->written_bytes;
+		sum->overrun_bytes += cpu_stats->overrun_bytes;
+
+		for (i = 0; i < NR_IOCTLS; i++) {
+			sum->ioctls[i] += cpu_stats->ioctls[i];
+		}
+
+		for (i = 0; i < LATENCY_SLOTS; i++) {
+			sum->read_latency[i]  += cpu_stats->read_latency[i];
+			sum->write_latency[i] += cpu_stats->write_latency[i];
+		}
+
+	}
+
+	seq_printf(m, "opens           %llu\n", sum->opens);
+	seq_printf(m, "busy            %llu\n", sum->busy);
+	seq_printf(m, "reads           %llu\n", sum->reads);
+	seq_printf(m, "read_bytes      %llu\n", sum->read_bytes);
+	seq_printf(m, "writes          %llu\n", sum->writes);
+	seq_printf(m, "written_bytes   %llu\n", sum->written_bytes);
+	seq_printf(m, "overrun_bytes   %llu\n", sum->overrun_bytes);
+
+	for (i = 0; i < NR_IOCTLS; i++) {
+		seq_printf(m, "%-19s %llu\n", Ioctl_Names[i], sum->ioctls[i]);
+	}
+
+	stats_show_latency(m, "read", sum->read_latency);
+	stats_show_latency(m, "write", sum->write_latency);
+
+	kfree(sum);
+
+	return SUCCESS;
+
+}
+
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/*
+ * Allocate the ring of the device with the given minor and make it
+ * available to user space.
+ *
+ */
+
+static int device_setup(struct chardev_device *dev, unsigned int minor) {
+
+	struct device *device;
+	int ret_val;
+
+	/*
+	 * vmalloc_user returns zeroed memory that is allowed to be mapped in
+	 * user space, so the device starts with an empty stream.
+	 *
+	 */
+
+	dev->mmap_buffer = vmalloc_user(PAGE_SIZE + ring_size);
+
+	if (!dev->mmap_buffer) {
+		printk(KERN_ALERT "Error: could not allocate %lu bytes for the ring\n",
+			ring_size);
+		return -ENOMEM;
+	}
+
+	dev->header = dev->mmap_buffer;
+	dev->ring   = dev->mmap_buffer + PAGE_SIZE;
+
+	dev->header->ring_size = ring_size;
+
+	dev->stats = alloc_percpu(struct chardev_stats);
+
+	if (!dev->stats) {
+		vfree(dev->mmap_buffer);
+		return -ENOMEM;
+	}
+
+	dev->minor = minor;
+
+	mutex_init(&dev->write_lock);
+	init_waitqueue_head(&dev->poll_queue);
+
+	/*
+	 * Tell the kernel that the files with this device number belong to
+	 * us. From now on the device can be opened.
+	 *
+	 */
+
+	cdev_init(&dev->cdev, &Fops);
+	dev->cdev.owner = THIS_MODULE;
+
+	ret_val = cdev_add(&dev->cdev, First_Dev + minor, 1);
+
+	if (ret_val < 0) {
+		printk(KERN_ALERT "Error: cdev_add: %d\n", ret_val);
+		free_percpu(dev->stats);
+		vfree(dev->mmap_buffer);
+		return ret_val;
+	}
+
+	/*
+	 * Let udev create /dev/char_device<minor>, so there is no need to run
+	 * mknod anymore.
+	 *
+	 */
+
+	device = device_create(Device_Class, NULL, First_Dev + minor, NULL,
+		DEVICE_NAME "%u", minor);
+
+	if (IS_ERR(device)) {
+		printk(KERN_ALERT "Error: device_create: %ld\n", PTR_ERR(device));
+		cdev_del(&dev->cdev);
+		free_percpu(dev->stats);
+		vfree(dev->mmap_buffer);
+		return PTR_ERR(device);
+	}
+
+	/*
+	 * A missing debugfs is not a reason to fail, the device works
+	 * without its statistics file.
+	 *
+	 */
+
+	debugfs_create_file(dev_name(device), 0444, Debug_Dir, dev, &stats_fops);
+
+	return SUCCESS;
+
+}
+
+/*
+ * Undo device_setup.
+ *
+ */
+
+static void device_teardown(struct chardev_device *dev, unsigned int minor) {
+
+	device_destroy(Device_Class, First_Dev + minor);
+	cdev_del(&dev->cdev);
+	free_percpu(dev->stats);
+	vfree(dev->mmap_buffer);
+
+}
+
+/*
+ * Remove the first count devices and give back everything init_module
+ * got for them.
+ *
+ */
+
+static void chardev_cleanup(unsigned int count) {
+
+	/*
+	 * The debugfs files show the statistics of the devices, remove them
+	 * first: debugfs_remove_recursive waits for the readers of the files,
+	 * so nobody looks at the statistics once they are freed.
+	 *
+	 */
+
+	debugfs_remove_recursive(Debug_Dir);
+
+	while (count--) {
+		device_teardown(&Devices[count], count);
+	}
+
+	kfree(Devices);
+	class_destroy(Device_Class);
+	unregister_chrdev_region(First_Dev, nr_devices);
+
+}
+
+int init_module() {
+
+	unsigned int minor;
+	int ret_val;
+
+	ring_size = roundup_pow_of_two(clamp(ring_size, RING_SIZE_MIN,
+		RING_SIZE_MAX));
+	nr_devices = clamp(nr_devices, 1U, NR_DEVICES_MAX);
+
+	/*
+	 * Unlike register_chrdev, which takes all the 256 minors of a fixed
+	 * major number, alloc_chrdev_region asks the kernel for a free major
+	 * number with exactly nr_devices minors.
+	 *
+	 */
+
+	ret_val = alloc_chrdev_region(&First_Dev, 0, nr_devices, DEVICE_NAME);
+
+	if (ret_val < 0) {
+		printk(KERN_ALERT "Error: alloc_chrdev_region: %d\n", ret_val);
+		return ret_val;
+	}
+
+	Device_Class = class_create(THIS_MODULE, DEVICE_NAME);
+
+	if (IS_ERR(Device_Class)) {
+		unregister_chrdev_region(First_Dev, nr_devices);
+		return PTR_ERR(Device_Class);
+	}
+
+	Devices = kcalloc(nr_devices, sizeof(*Devices), GFP_KERNEL);
+
+	if (!Devices) {
+		class_destroy(Device_Class);
+		unregister_chrdev_region(First_Dev, nr_devices);
+		return -ENOMEM;
+	}
+
+	Debug_Dir = debugfs_create_dir(DEVICE_NAME, NULL);
+
+	for (minor = 0; minor < nr_devices; minor++) {
+
+		ret_val = device_setup(&Devices[minor], minor);
+
+		if (ret_val < 0) {
+			chardev_cleanup(minor);
+			return ret_val;
+		}
+
+	}
+
+	printk(KERN_INFO "Successfully registered %u devices with the major number %d"
+		" as /dev/%s0 ... /dev/%s%u\n", nr_devices, MAJOR(First_Dev),
+		DEVICE_NAME, DEVICE_NAME, nr_devices - 1);
+
+	return SUCCESS;
+
+}
+
+void cleanup_module() {
+
+	/*
+	 * Remove the devices and unregister the device numbers.
+	 *
+	 */
+
+	chardev_cleanup(nr_devices);
+
 	printk(KERN_INFO "device unregistered\n");
 
 }
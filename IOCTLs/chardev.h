@@ -8,19 +8,28 @@
  */
 
 /*
- * Name of the device file.
+ * Name of the device files. The module creates nr_devices of them,
+ * /dev/char_device0, /dev/char_device1 and so on.
  *
  */
 #define DEVICE_NAME "char_device"
 
 /*
- * Major number of the device. We cannot rely on dynamic registration
- * anymore because ioctls need to know it.
+ * The device file opened by ioctl.c.
+ *
+ */
+#define DEVICE_PATH "/dev/" DEVICE_NAME "0"
+
+/*
+ * Type of the ioctls of the device. It used to be the major number of the
+ * device, which was fixed so that the ioctls could use it. The major number
+ * is allocated dynamically now, but the ioctls keep the same value so the
+ * programs built against this header still work.
  *
  * It is used in IOCTL_SET_MSG.
  *
  */
-#define CHRDEV_MAJOR 100
+#define CHRDEV_IOC_MAGIC 100
 
 /*
  * Set the message of the device driver. _IOR means that we are reading
@@ -31,27 +40,145 @@
  * Arguments
  * ---------
  *
- * 1. type      - major device number
+ * 1. type      - CHRDEV_IOC_MAGIC
  * 2. number    - number of the command, needs to be different to distinguish
  * 	between ioctls
  * 3. data_type - type of the data going into the kernel or coming out of the 
  * 	kernel
  *
  */
-#define IOCTL_SET_MSG _IOR(CHRDEV_MAJOR, 0, char *)
+#define IOCTL_SET_MSG _IOR(CHRDEV_IOC_MAGIC, 0, char *)
 
 /*
  * Get the message of the device driver. This IOCTL is used for output, to get
  * the message of the device driver.
  *
  */
-#define IOCTL_GET_MSG _IOR(CHRDEV_MAJOR, 1, char *)
+#define IOCTL_GET_MSG _IOR(CHRDEV_IOC_MAGIC, 1, char *)
 
 /*
  * Get the n-th byte of the message. This IOCTL is used for both input and
  * output, It receives from the user a number, n, and returns Message[n].
  *
  */
-#define IOCTL_GET_NTH_BYTE _IOWR(CHRDEV_MAJOR, 2, int)
+#define IOCTL_GET_NTH_BYTE _IOWR(CHRDEV_IOC_MAGIC, 2, int)
+
+/*
+ * A slice of the message, used by IOCTL_GET_RANGE and IOCTL_GET_RANGES.
+ *
+ * offset - offset of the slice in the message
+ * length - number of bytes wanted, updated by the driver to the number of
+ * 	bytes actually copied (less if the message ends sooner)
+ * buffer - user space buffer the slice is copied in, kept as an integer so
+ * 	the structure looks the same for 32 and 64 bit processes
+ *
+ */
+struct chardev_range {
+	unsigned long long offset;
+	unsigned long long length;
+	unsigned long long buffer;
+};
+
+/*
+ * An array of slices for IOCTL_GET_RANGES.
+ *
+ * count  - number of elements in the array, at most CHARDEV_MAX_RANGES
+ * ranges - user space pointer to the first struct chardev_range
+ *
+ */
+struct chardev_ranges {
+	unsigned long long count;
+	unsigned long long ranges;
+};
+
+#define CHARDEV_MAX_RANGES 1024
+
+/*
+ * Get a slice of the message with one ioctl, instead of one
+ * IOCTL_GET_NTH_BYTE per byte. A slice past the end of the message copies
+ * nothing; one whose offset + length does not fit in 64 bits fails with
+ * EINVAL.
+ *
+ */
+#define IOCTL_GET_RANGE _IOWR(CHRDEV_IOC_MAGIC, 3, struct chardev_range)
+
+/*
+ * Get many slices of the message, each in its own buffer (scatter-gather),
+ * with one ioctl. All of them are taken from the same message.
+ *
+ */
+#define IOCTL_GET_RANGES _IOWR(CHRDEV_IOC_MAGIC, 4, struct chardev_ranges)
+
+/*
+ * Argument of IOCTL_GET_MSG_V1.
+ *
+ * version  - must be CHARDEV_MSG_VERSION, new fields can only be added
+ * 	together with a new version
+ * flags    - no flags are defined yet, must be 0
+ * buffer   - user space buffer the message is copied in
+ * capacity - size of buffer, can be 0 to only ask for the length
+ * length   - set by the driver to the full length of the message, which is
+ * 	more than capacity if the message did not fit
+ *
+ * Unlike IOCTL_GET_MSG, the message is not followed by a 0.
+ *
+ */
+struct chardev_msg {
+	unsigned int       version;
+	unsigned int       flags;
+	unsigned long long buffer;
+	unsigned long long capacity;
+	unsigned long long length;
+};
+
+#define CHARDEV_MSG_VERSION 1
+
+/*
+ * Get the message of the device driver without overflowing the buffer of
+ * the process: at most capacity bytes are copied, with a single copy, and
+ * the full length is reported so the process knows how big its buffer has
+ * to be.
+ *
+ */
+#define IOCTL_GET_MSG_V1 _IOWR(CHRDEV_IOC_MAGIC, 5, struct chardev_msg)
+
+/*
+ * The data written in the device is kept in a ring buffer, which can also
+ * be read without any system call by mapping the device file with mmap.
+ * The first page of the mapping holds this header and the ring starts on
+ * the second page (at sysconf(_SC_PAGESIZE)).
+ *
+ * Every byte written in the device gets a position in the stream of data,
+ * starting with 0 when the module is loaded. The byte at position pos is
+ * kept at index pos & (ring_size - 1) of the ring.
+ *
+ * generation - incremented once before the module starts changing the
+ * 	header and once after it is done, so it is odd while the header is
+ * 	being changed
+ * ring_size  - size of the ring in bytes, a power of two
+ * head       - position right after the last byte written
+ * reserved   - position right after the last byte a writer is going to
+ * 	write, so bytes before reserved - ring_size may be overwritten
+ * message    - position of the latest message (the data given by the last
+ * 	write or IOCTL_SET_MSG)
+ * length     - length of the latest message
+ *
+ * To read from the mapping, wait for an even generation, read the fields
+ * needed, copy the data, then read reserved and the generation again. The
+ * copy is consistent if the generation is still the same and the data is
+ * still inside the ring (message >= reserved - ring_size), otherwise try
+ * again: a writer which reserved its space before the copy started may
+ * have overwritten the data without changing the generation. A reader
+ * also learns that there is new data by seeing a different generation.
+ *
+ */
+struct chardev_mmap_header {
+	unsigned int       generation;
+	unsigned int       ring_size;
+	unsigned long long head;
+	unsigned long long reserved;
+	unsigned long long message;
+	unsigned int       length;
+};
 
 #endif
@@ -0,0 +1,430 @@
+/*
+ * Load generator for char_device.
+ *
+ * Every thread opens its own file descriptor and runs a random mix of
+ * reads, writes and ioctls against the device, timing each call. At the
+ * end the latencies of all the threads are merged and the program prints
+ * the throughput and the p50/p99/p999 latency of every kind of operation.
+ *
+ * Usage:
+ * 	./chardev_bench [-t threads] [-s size] [-n operations] [-m mix]
+ * 		[-d device]
+ *
+ * 	-t  number of threads (default 4)
+ * 	-s  size in bytes of every read, write and ioctl (default 64)
+ * 	-n  operations per thread (default 100000)
+ * 	-m  weights of read:write:ioctl (default 8:1:1)
+ * 	-d  device file (default DEVICE_PATH)
+ *
+ * The ioctl used is IOCTL_GET_MSG_V1, which copies at most `size` bytes
+ * of the last message.
+ *
+ */
+
+/*
+ * The header file of the kernel module is needed for the IOCTL numbers
+ * and struct chardev_msg.
+ *
+ */
+#include "chardev.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_SIZE 64
+#define DEFAULT_OPERATIONS 100000
+
+enum operation {
+	OP_READ,
+	OP_WRITE,
+	OP_IOCTL,
+	NR_OPS,
+};
+
+static const char *Op_Names[NR_OPS] = {
+	[OP_READ]  = "read",
+	[OP_WRITE] = "write",
+	[OP_IOCTL] = "ioctl",
+};
+
+/*
+ * Description
+ * -----------
+ *
+ * 	path       - the device file every thread opens
+ * 	size       - bytes moved by every operation
+ * 	operations - operations run by every thread
+ * 	mix        - relative weight of each operation
+ *
+ */
+struct bench_config {
+
+	const char *path;
+	size_t size;
+	long operations;
+	unsigned int mix[NR_OPS];
+
+};
+
+/*
+ * What a thread measured. latency[op] holds the duration in nanoseconds
+ * of each of the count[op] calls of that kind.
+ *
+ */
+struct bench_thread {
+
+	pthread_t thread;
+	unsigned int id;
+	const struct bench_config *config;
+
+	long count[NR_OPS];
+	long errors[NR_OPS];
+	long long *latency[NR_OPS];
+
+};
+
+static long long now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+}
+
+/*
+ * Pick an operation at random, following the weights of the mix.
+ *
+ */
+static enum operation pick_operation(const struct bench_config *config,
+	unsigned int *seed) {
+
+	unsigned int total = 0;
+	unsigned int pick;
+	int op;
+
+	for (op = 0; op < NR_OPS; op++) {
+		total += config->mix[op];
+	}
+
+	pick = rand_r(seed) % total;
+
+	for (op = 0; op < NR_OPS - 1; op++) {
+		if (pick < config->mix[op]) {
+			break;
+		}
+		pick -= config->mix[op];
+	}
+
+	return op;
+
+}
+
+/*
+ * Body of every thread.
+ *
+ * Readers follow the stream with read, like real consumers of the device:
+ * the kernel keeps the position of every file descriptor and moves it to
+ * the oldest data still in the ring when writers overrun it. A reader
+ * which caught up with the writers gets 0 until more data is written,
+ * those calls are timed as reads too.
+ *
+ */
+static void *bench_thread(void *arg) {
+
+	struct bench_thread *thread = arg;
+	const struct bench_config *config = thread->config;
+	unsigned int seed = thread->id * 2654435761U + 1;
+	struct chardev_msg msg;
+	enum operation op;
+	long long start;
+	ssize_t ret_val;
+	char *buffer;
+	long i;
+	int fd;
+
+	buffer = malloc(config->size);
+	if (!buffer) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(buffer, 'a' + thread->id % 26, config->size);
+
+	fd = open(config->path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open device file %s: %s\n", config->path,
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < config->operations; i++) {
+
+		op = pick_operation(config, &seed);
+		start = now_ns();
+
+		switch (op) {
+
+			case OP_READ:
+				ret_val = read(fd, buffer, config->size);
+				break;
+
+			case OP_WRITE:
+				ret_val = write(fd, buffer, config->size);
+				break;
+
+			default:
+				msg = (struct chardev_msg) {
+					.version = CHARDEV_MSG_VERSION,
+					.buffer = (unsigned long) buffer,
+					.capacity = config->size,
+				};
+				ret_val = ioctl(fd, IOCTL_GET_MSG_V1, &msg);
+				break;
+
+		}
+
+		thread->latency[op][thread->count[op]++] = now_ns() - start;
+
+		if (ret_val < 0) {
+			thread->errors[op]++;
+		}
+
+	}
+
+	close(fd);
+	free(buffer);
+
+	return NULL;
+
+}
+
+static int compare_latency(const void *a, const void *b) {
+
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+
+}
+
+/*
+ * Latency below which `permille` thousandths of the sorted samples are.
+ *
+ */
+static double percentile_us(const long long *sorted, long count,
+	unsigned int permille) {
+
+	long index = count * permille / 1000;
+
+	if (index >= count) {
+		index = count - 1;
+	}
+
+	return sorted[index] / 1e3;
+
+}
+
+static void print_line(const char *name, long long *latency, long count,
+	long errors, double elapsed) {
+
+	if (count == 0) {
+		return;
+	}
+
+	qsort(latency, count, sizeof(*latency), compare_latency);
+
+	printf("%-6s %10ld %12.0f %10.2f %10.2f %10.2f %8ld\n", name, count,
+		count / elapsed, percentile_us(latency, count, 500),
+		percentile_us(latency, count, 990), percentile_us(latency, count, 999),
+		errors);
+
+}
+
+/*
+ * Merge the samples of all the threads and print one line per operation
+ * and one for all of them together.
+ *
+ */
+static void report(struct bench_thread *threads, unsigned int nr_threads,
+	long operations, double elapsed) {
+
+	long long *merged, *all;
+	long count, all_count, errors, all_errors;
+	unsigned int t;
+	int op;
+
+	merged = malloc(nr_threads * operations * sizeof(*merged));
+	all = malloc(nr_threads * operations * sizeof(*all));
+	if (!merged || !all) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-6s %10s %12s %10s %10s %10s %8s\n", "op", "count", "ops/s",
+		"p50 us", "p99 us", "p999 us", "errors");
+
+	all_count = 0;
+	all_errors = 0;
+
+	for (op = 0; op < NR_OPS; op++) {
+
+		count = 0;
+		errors = 0;
+
+		for (t = 0; t < nr_threads; t++) {
+			memcpy(merged + count, threads[t].latency[op],
+				threads[t].count[op] * sizeof(*merged));
+			count += threads[t].count[op];
+			errors += threads[t].errors[op];
+		}
+
+		memcpy(all + all_count, merged, count * sizeof(*all));
+		all_count += count;
+		all_errors += errors;
+
+		print_line(Op_Names[op], merged, count, errors, elapsed);
+
+	}
+
+	print_line("total", all, all_count, all_errors, elapsed);
+
+	free(all);
+	free(merged);
+
+}
+
+static void usage(const char *name) {
+
+	fprintf(stderr, "Usage: %s [-t threads] [-s size] [-n operations]"
+		" [-m read:write:ioctl] [-d device]\n", name);
+	exit(EXIT_FAILURE);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	struct bench_config config = {
+		.path = DEVICE_PATH,
+		.size = DEFAULT_SIZE,
+		.operations = DEFAULT_OPERATIONS,
+		.mix = { [OP_READ] = 8, [OP_WRITE] = 1, [OP_IOCTL] = 1 },
+	};
+	unsigned int nr_threads = DEFAULT_THREADS;
+	struct bench_thread *threads;
+	double start, elapsed;
+	unsigned int t;
+	int op, opt;
+
+	while ((opt = getopt(argc, argv, "t:s:n:m:d:")) != -1) {
+
+		switch (opt) {
+
+			case 't':
+				nr_threads = atoi(optarg);
+				break;
+
+			case 's':
+				config.size = atol(optarg);
+				break;
+
+			case 'n':
+				config.operations = atol(optarg);
+				break;
+
+			case 'm':
+				if (sscanf(optarg, "%u:%u:%u", &config.mix[OP_READ],
+					&config.mix[OP_WRITE], &config.mix[OP_IOCTL]) != 3) {
+					usage(argv[0]);
+				}
+				break;
+
+			case 'd':
+				config.path = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+
+		}
+
+	}
+
+	if (nr_threads == 0 || config.size == 0 || config.operations <= 0 ||
+		config.mix[OP_READ] + config.mix[OP_WRITE] + config.mix[OP_IOCTL] == 0) {
+		usage(argv[0]);
+	}
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * The samples are allocated before the threads start so that the
+	 * measurement does not include page faults of the allocator.
+	 *
+	 */
+
+	for (t = 0; t < nr_threads; t++) {
+
+		threads[t].id = t;
+		threads[t].config = &config;
+
+		for (op = 0; op < NR_OPS; op++) {
+
+			threads[t].latency[op] = calloc(config.operations,
+				sizeof(long long));
+
+			if (!threads[t].latency[op]) {
+				perror("calloc");
+				exit(EXIT_FAILURE);
+			}
+
+		}
+
+	}
+
+	printf("%u thread(s), %zu byte(s) per operation, %ld operations per"
+		" thread, mix %u:%u:%u\n", nr_threads, config.size, config.operations,
+		config.mix[OP_READ], config.mix[OP_WRITE], config.mix[OP_IOCTL]);
+
+	start = now_ns() / 1e9;
+
+	for (t = 0; t < nr_threads; t++) {
+		if (pthread_create(&threads[t].thread, NULL, bench_thread,
+			&threads[t])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (t = 0; t < nr_threads; t++) {
+		pthread_join(threads[t].thread, NULL);
+	}
+
+	elapsed = now_ns() / 1e9 - start;
+
+	report(threads, nr_threads, config.operations, elapsed);
+
+	for (t = 0; t < nr_threads; t++) {
+		for (op = 0; op < NR_OPS; op++) {
+			free(threads[t].latency[op]);
+		}
+	}
+
+	free(threads);
+
+	return EXIT_SUCCESS;
+
+}
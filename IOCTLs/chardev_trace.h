@@ -0,0 +1,135 @@
+/*
+ * Tracepoints of the char_device module. They replace the printk calls
+ * which used to log every open, read, write and release: a tracepoint
+ * costs almost nothing while it is disabled and does not go through the
+ * console when it is enabled.
+ *
+ * To turn them on or off at runtime:
+ * 	'echo 1 > /sys/kernel/tracing/events/chardev/enable'
+ * 	'cat /sys/kernel/tracing/trace_pipe'
+ * 	'echo 0 > /sys/kernel/tracing/events/chardev/enable'
+ *
+ * This header is read several times by the tracing macros, so the include
+ * guard must let TRACE_HEADER_MULTI_READ through.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM chardev
+
+#if !defined(CHARDEV_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define CHARDEV_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/*
+ * Open and release of a device file.
+ *
+ */
+DECLARE_EVENT_CLASS(chardev_file,
+
+	TP_PROTO(unsigned int minor, struct file *file),
+
+	TP_ARGS(minor, file),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(void *,       file)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->file  = file;
+	),
+
+	TP_printk("char_device%u file=%p", __entry->minor, __entry->file)
+);
+
+DEFINE_EVENT(chardev_file, chardev_open,
+	TP_PROTO(unsigned int minor, struct file *file),
+	TP_ARGS(minor, file)
+);
+
+DEFINE_EVENT(chardev_file, chardev_release,
+	TP_PROTO(unsigned int minor, struct file *file),
+	TP_ARGS(minor, file)
+);
+
+/*
+ * A read or a write: the position in the stream, the number of bytes asked
+ * for and the result of the operation.
+ *
+ */
+DECLARE_EVENT_CLASS(chardev_io,
+
+	TP_PROTO(unsigned int minor, loff_t pos, size_t length, ssize_t ret),
+
+	TP_ARGS(minor, pos, length, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t,       pos)
+		__field(size_t,       length)
+		__field(ssize_t,      ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor  = minor;
+		__entry->pos    = pos;
+		__entry->length = length;
+		__entry->ret    = ret;
+	),
+
+	TP_printk("char_device%u pos=%lld length=%zu ret=%zd", __entry->minor,
+		__entry->pos, __entry->length, __entry->ret)
+);
+
+DEFINE_EVENT(chardev_io, chardev_read,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t length, ssize_t ret),
+	TP_ARGS(minor, pos, length, ret)
+);
+
+DEFINE_EVENT(chardev_io, chardev_write,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t length, ssize_t ret),
+	TP_ARGS(minor, pos, length, ret)
+);
+
+/*
+ * An ioctl and its result.
+ *
+ */
+TRACE_EVENT(chardev_ioctl,
+
+	TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+
+	TP_ARGS(minor, cmd, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(long,         ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd   = cmd;
+		__entry->ret   = ret;
+	),
+
+	TP_printk("char_device%u cmd=%#x ret=%ld", __entry->minor,
+		__entry->cmd, __entry->ret)
+);
+
+#endif
+
+/*
+ * The header is not in include/trace/events, tell define_trace.h where to
+ * find it (the Makefile adds this directory to the include path).
+ *
+ */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE chardev_trace
+
+#include <trace/define_trace.h>
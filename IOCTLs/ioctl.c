@@ -12,12 +12,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #define BUFLEN 100
 
+/*
+ * Number of times the benchmark reads the whole message if no count is
+ * given on the command line.
+ *
+ */
+#define BENCH_ITERATIONS 100000
+
 /*
  * Functions for the IOCTL calls.
  *
@@ -71,10 +81,10 @@ void ioctl_get_msg(int fd) {
 	char message[BUFLEN];
 
 	/*
-	 * This may cause overflow because the process does not know the size of
-	 * the internal buffer of the module. In a real program, two IOCTLs
-	 * must be used. One to tell the module how much is allowed to write
-	 * and one to actually get the buffer.
+	 * The process does not tell the module the size of its buffer, the
+	 * module copies at most BUFLEN bytes. IOCTL_GET_MSG_V1 (see
+	 * ioctl_get_msg_v1) passes the size of the buffer and gets back the
+	 * length of the message instead.
 	 *
 	 */
 
@@ -91,21 +101,468 @@ void ioctl_get_msg(int fd) {
 
 }
 
+/*
+ * Get the message with IOCTL_GET_MSG_V1. The first call only asks for the
+ * length, so the buffer can be allocated with the right size once. If a
+ * longer message was written in between, the second call still does not
+ * overflow the buffer and tells us it was cut.
+ *
+ */
+void ioctl_get_msg_v1(int fd) {
+
+	int ret_val;
+	char *message;
+	struct chardev_msg msg = {
+		.version  = CHARDEV_MSG_VERSION,
+		.capacity = 0,
+	};
+
+	ret_val = ioctl(fd, IOCTL_GET_MSG_V1, &msg);
+
+	if (ret_val < 0) {
+
+		printf("ioctl_get_msg_v1 failed: %d\n", ret_val);
+		exit(EXIT_FAILURE);
+
+	}
+
+	message = malloc(msg.length + 1);
+	if (!message) {
+		perror("ioctl_get_msg_v1");
+		exit(EXIT_FAILURE);
+	}
+
+	msg.buffer   = (unsigned long) message;
+	msg.capacity = msg.length;
+
+	ret_val = ioctl(fd, IOCTL_GET_MSG_V1, &msg);
+
+	if (ret_val < 0) {
+
+		printf("ioctl_get_msg_v1 failed: %d\n", ret_val);
+		exit(EXIT_FAILURE);
+
+	}
+
+	if (msg.length > msg.capacity) {
+		printf("ioctl_get_msg_v1 message was cut from %llu bytes\n",
+			msg.length);
+		msg.length = msg.capacity;
+	}
+
+	message[msg.length] = 0;
+	printf("ioctl_get_msg_v1 message (%llu bytes): %s\n", msg.length,
+		message);
+
+	free(message);
+
+}
+/*
+ * Fetch the whole message with a single IOCTL_GET_RANGE, where
+ * ioctl_get_nth_byte needs one ioctl per byte.
+ *
+ */
+void ioctl_get_range(int fd) {
+
+	int ret_val;
+	char message[BUFLEN];
+	struct chardev_range range = {
+		.offset = 0,
+		.length = BUFLEN - 1,
+		.buffer = (unsigned long) message,
+	};
+
+	ret_val = ioctl(fd, IOCTL_GET_RANGE, &range);
+
+	if (ret_val < 0) {
+
+		printf("ioctl_get_range failed: %d\n", ret_val);
+		exit(EXIT_FAILURE);
+
+	}
+
+	message[range.length] = 0;
+	printf("ioctl_get_range message (1 ioctl instead of %llu): %s\n",
+		range.length + 1, message);
+
+}
+
+/*
+ * Fetch the two halves of the message in two different buffers with a
+ * single IOCTL_GET_RANGES.
+ *
+ */
+void ioctl_get_ranges(int fd) {
+
+	int ret_val;
+	char first[BUFLEN], second[BUFLEN];
+	struct chardev_range range[2] = {
+		{ .offset = 0,          .length = BUFLEN / 2,
+		  .buffer = (unsigned long) first },
+		{ .offset = BUFLEN / 2, .length = BUFLEN / 2 - 1,
+		  .buffer = (unsigned long) second },
+	};
+	struct chardev_ranges request = {
+		.count  = 2,
+		.ranges = (unsigned long) range,
+	};
+
+	ret_val = ioctl(fd, IOCTL_GET_RANGES, &request);
+
+	if (ret_val < 0) {
+
+		printf("ioctl_get_ranges failed: %d\n", ret_val);
+		exit(EXIT_FAILURE);
+
+	}
+
+	first[range[0].length]  = 0;
+	second[range[1].length] = 0;
+	printf("ioctl_get_ranges message: %s%s\n", first, second);
+
+}
+
+/*
+ * Size of the mapping made by mmap_device.
+ *
+ */
+size_t mmap_size(struct chardev_mmap_header *header) {
+
+	return sysconf(_SC_PAGESIZE) + header->ring_size;
+
+}
+
+/*
+ * Map the header page and the ring of the device. The size of the ring is
+ * only known after looking at the header, so map the header alone first.
+ *
+ */
+struct chardev_mmap_header *mmap_device(int fd) {
+
+	void *mapping;
+	size_t size;
+
+	mapping = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+
+	if (mapping == MAP_FAILED) {
+		perror("mmap_device");
+		exit(EXIT_FAILURE);
+	}
+
+	size = mmap_size(mapping);
+	munmap(mapping, sysconf(_SC_PAGESIZE));
+
+	mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (mapping == MAP_FAILED) {
+		perror("mmap_device");
+		exit(EXIT_FAILURE);
+	}
+
+	return mapping;
+
+}
+
+/*
+ * Copy the latest message from the mapping in message (at most BUFLEN - 1
+ * bytes of it) without any system call, following the protocol described
+ * in chardev.h. Returns the generation of the copied message.
+ *
+ */
+unsigned int mmap_read_msg(struct chardev_mmap_header *header,
+	char *message) {
+
+	const char *ring = (const char *) header + sysconf(_SC_PAGESIZE);
+	unsigned int generation;
+	unsigned int length;
+	unsigned long long pos, reserved;
+	size_t index, first;
+
+	do {
+
+		generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+		if (generation & 1) {
+			continue;
+		}
+
+		length = header->length;
+		if (length > BUFLEN - 1) {
+			length = BUFLEN - 1;
+		}
+
+		/*
+		 * The message may wrap around the end of the ring.
+		 *
+		 */
+
+		pos = header->message;
+		index = pos & (header->ring_size - 1);
+		first = header->ring_size - index;
+		if (first > length) {
+			first = length;
+		}
+
+		memcpy(message, ring + index, first);
+		memcpy(message + first, ring, length - first);
+		message[length] = 0;
+
+		/*
+		 * A writer may have reserved the space of the message before
+		 * the generation was read and be overwriting it during the
+		 * copy, without changing the generation again. The copy is only
+		 * good if the message is still inside the ring afterwards.
+		 *
+		 */
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		reserved = __atomic_load_n(&header->reserved, __ATOMIC_RELAXED);
+
+	} while ((generation & 1) || pos + header->ring_size < reserved ||
+		__atomic_load_n(&header->generation, __ATOMIC_RELAXED) != generation);
+
+	return generation;
+
+}
+
+void mmap_get_msg(int fd) {
+
+	char message[BUFLEN];
+	struct chardev_mmap_header *header;
+
+	header = mmap_device(fd);
+
+	mmap_read_msg(header, message);
+	printf("mmap_get_msg message: %s\n", message);
+
+	munmap(header, mmap_size(header));
+
+}
+
+/*
+ * Monotonic time in seconds, used to measure the benchmark.
+ *
+ */
+double now_seconds(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/*
+ * Read the whole message, which starts at position start of the stream,
+ * `iterations` times asking for `chunk` bytes per read and print the
+ * throughput.
+ *
+ * With chunk = 1 every byte costs a system call, which is the cost every
+ * byte had inside the module when it moved data with put_user/get_user
+ * loops. With chunk = BUFLEN the module serves the message with a single
+ * copy_to_user.
+ *
+ */
+void bench_read(int fd, off_t start_pos, size_t chunk, long iterations) {
+
+	long i;
+	ssize_t ret_val;
+	off_t offset;
+	size_t total = 0;
+	double start, elapsed;
+	char buffer[BUFLEN];
+
+	start = now_seconds();
+
+	for (i = 0; i < iterations; i++) {
+
+		offset = start_pos;
+		while ((ret_val = pread(fd, buffer, chunk, offset)) > 0) {
+			offset += ret_val;
+		}
+
+		if (ret_val < 0) {
+			perror("bench_read");
+			exit(EXIT_FAILURE);
+		}
+
+		total += offset - start_pos;
+
+	}
+
+	elapsed = now_seconds() - start;
+
+	printf("%3zu byte(s) per read: %zu bytes in %.3f s, %.2f MB/s\n",
+		chunk, total, elapsed, total / elapsed / 1e6);
+
+}
+
+/*
+ * Fetch the message `iterations` times, first with IOCTL_GET_MSG and then
+ * straight from the mapping, and print how many messages per second each
+ * way delivers.
+ *
+ */
+void bench_mmap(int fd, long iterations) {
+
+	long i;
+	double start, elapsed;
+	char message[BUFLEN];
+	struct chardev_mmap_header *header;
+
+	start = now_seconds();
+
+	for (i = 0; i < iterations; i++) {
+		if (ioctl(fd, IOCTL_GET_MSG, message) < 0) {
+			perror("bench_mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	elapsed = now_seconds() - start;
+	printf("IOCTL_GET_MSG: %.0f messages/s\n", iterations / elapsed);
+
+	header = mmap_device(fd);
+	start = now_seconds();
+
+	for (i = 0; i < iterations; i++) {
+		mmap_read_msg(header, message);
+	}
+
+	elapsed = now_seconds() - start;
+	printf("mmap:          %.0f messages/s\n", iterations / elapsed);
+
+	munmap(header, mmap_size(header));
+
+}
+
+/*
+ * Fetch the message `iterations` times, first one byte per ioctl with
+ * IOCTL_GET_NTH_BYTE and then with a single IOCTL_GET_RANGE, and print the
+ * number of system calls and the time each way takes.
+ *
+ */
+void bench_range(int fd, long iterations) {
+
+	long i, n, calls;
+	double start, elapsed;
+	char message[BUFLEN];
+	struct chardev_range range = {
+		.offset = 0,
+		.length = BUFLEN - 1,
+		.buffer = (unsigned long) message,
+	};
+
+	calls = 0;
+	start = now_seconds();
+
+	for (i = 0; i < iterations; i++) {
+		n = 0;
+		do {
+			calls++;
+			message[n] = ioctl(fd, IOCTL_GET_NTH_BYTE, n);
+		} while (message[n++] > 0 && n < BUFLEN);
+	}
+
+	elapsed = now_seconds() - start;
+	printf("IOCTL_GET_NTH_BYTE: %ld ioctls, %.0f messages/s\n", calls,
+		iterations / elapsed);
+
+	calls = 0;
+	start = now_seconds();
+
+	for (i = 0; i < iterations; i++) {
+		calls++;
+		if (ioctl(fd, IOCTL_GET_RANGE, &range) < 0) {
+			perror("bench_range");
+			exit(EXIT_FAILURE);
+		}
+		range.length = BUFLEN - 1;
+	}
+
+	elapsed = now_seconds() - start;
+	printf("IOCTL_GET_RANGE:    %ld ioctls, %.0f messages/s\n", calls,
+		iterations / elapsed);
+
+}
+
+/*
+ * Compare the per-byte data path with the bulk one on a message of
+ * BUFLEN - 1 bytes.
+ *
+ */
+void benchmark(int fd, long iterations) {
+
+	char message[BUFLEN - 1];
+	struct chardev_mmap_header *header;
+	off_t start_pos;
 
-int main() {
+	memset(message, 'x', sizeof(message));
+
+	if (write(fd, message, sizeof(message)) < 0) {
+		perror("benchmark");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * The header tells where the message starts in the stream.
+	 *
+	 */
+
+	header = mmap_device(fd);
+	start_pos = header->message;
+	munmap(header, mmap_size(header));
+
+	bench_read(fd, start_pos, 1, iterations);
+	bench_read(fd, start_pos, BUFLEN, iterations);
+	bench_range(fd, iterations);
+
+}
+
+int main(int argc, char *argv[]) {
 
 	int fd;
 	char *msg = "Message used form IOCTLs\n";
 
-	fd = open(DEVICE_NAME, 0);
+	fd = open(DEVICE_PATH, O_RDWR);
 	if (fd < 0) {
-		printf("Cannot open device file: %s\n", DEVICE_NAME);
+		printf("Cannot open device file: %s\n", DEVICE_PATH);
 		exit(EXIT_FAILURE);
 	}
 
+	/*
+	 * `./ioctl bench [iterations]` measures the throughput of the data
+	 * path instead of running the IOCTLs, `./ioctl mmap [iterations]`
+	 * compares IOCTL_GET_MSG with reading the message from a mapping.
+	 *
+	 */
+
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+
+		benchmark(fd, argc > 2 ? atol(argv[2]) : BENCH_ITERATIONS);
+		close(fd);
+
+		return EXIT_SUCCESS;
+
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "mmap")) {
+
+		ioctl_set_msg(fd, msg);
+		bench_mmap(fd, argc > 2 ? atol(argv[2]) : BENCH_ITERATIONS);
+		close(fd);
+
+		return EXIT_SUCCESS;
+
+	}
+
 	ioctl_set_msg(fd, msg);
 	ioctl_get_nth_byte(fd);
 	ioctl_get_msg(fd);
+	ioctl_get_msg_v1(fd);
+	ioctl_get_range(fd);
+	ioctl_get_ranges(fd);
+	mmap_get_msg(fd);
 
 	close(fd);
 
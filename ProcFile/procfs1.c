@@ -1,12 +1,53 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
-#include <asm/uaccess.h>
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/mm.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/stringhash.h>
+#include <linux/uaccess.h>
+
+#include "procfs1.h"
 
 #define PROCFS_NAME "helloworld"
 #define PERMS 0644
+#define RAW_PERMS 0444
 
-#define BUFLEN 50
+#define SUCCESS 0
+
+/*
+ * CHUNK_SIZE - bytes copied from user space at a time by proc_write
+ * LINE_LEN   - longest line accepted, including the newline
+ * BATCH_MIN  - updates a batch has room for when it first grows
+ * BATCH_MAX  - most updates applied by one write, the rest of the write
+ *              is left to the next one
+ *
+ */
+#define CHUNK_SIZE PAGE_SIZE
+#define LINE_LEN   64
+#define BATCH_MIN  64
+#define BATCH_MAX  16384
+
+/*
+ * KEY_LEN     - room for a key, including the terminating NUL
+ * DEFAULT_KEY - key set by a line holding only a value
+ * MAX_ENTRIES - number of keys the store accepts
+ *
+ */
+#define KEY_LEN     32
+#define DEFAULT_KEY "integer"
+#define MAX_ENTRIES 4096
+
+/*
+ * The store has 1 << ENTRIES_BITS buckets.
+ *
+ */
+#define ENTRIES_BITS 8
 
 /*
  * Informations about the module. Can be retrieved using `modinfo` command.
@@ -14,97 +55,568 @@
  */
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("LUCIAN");
-MODULE_DESCRIPTION("A simple proc file that reads and writes in an integer "
-	"keept in kernel space");
+MODULE_DESCRIPTION("A simple proc file that reads and writes integers "
+	"keept in kernel space, by name");
 
 /*
- * proc_write will write to this value and proc_read will read
- * from this value
+ * A named integer.
+ *
+ * Description
+ * -----------
+ *
+ * 	node  - link in its bucket of Entries
+ * 	hash  - hash of key, it tells the bucket
+ * 	key   - name of the integer
+ * 	value - the integer, atomic so that increments and compare and swap
+ * 	        from many writers need no lock
  *
  */
-int integer_from_user;
+struct proc_entry {
+
+	struct hlist_node node;
+	u32 hash;
+	char key[KEY_LEN];
+	atomic64_t value;
+
+};
 
 /*
- * In this structure we hold information about the /proc file.
+ * proc_write adds keys to this table and changes their values, proc_read
+ * lists them.
+ *
+ * Lookups and reads walk the buckets under RCU only, Entries_Lock is taken
+ * just to add a key. Keys are never removed while the module is loaded, so
+ * an entry found under RCU stays valid.
+ *
+ */
+static DEFINE_HASHTABLE(Entries, ENTRIES_BITS);
+static DEFINE_SPINLOCK(Entries_Lock);
+static unsigned int Nr_Entries;
+
+/*
+ * The entry of DEFAULT_KEY, created with the module so that the binary proc
+ * file can read it without a lookup.
+ *
+ */
+static struct proc_entry *Default_Entry;
+
+/*
+ * Number of batches applied, see struct procfs1_raw.
+ *
+ */
+static atomic64_t Sequence = ATOMIC64_INIT(0);
+
+/*
+ * In these structures we hold information about the /proc files.
  *
  */
 struct proc_dir_entry *Proc_File;
+struct proc_dir_entry *Proc_Raw_File;
 
 /*
- * Arguments
- * ---------
+ * Find the entry of key. The caller holds rcu_read_lock or Entries_Lock.
  *
- * 1. File object representing an open file from user space
- * 2. User space buffer
- * 3. Buffer size
- * 4. Requested position (this will be updated)
+ */
+static struct proc_entry *entry_lookup(const char *key, u32 hash) {
+
+	struct proc_entry *entry;
+
+	hash_for_each_possible_rcu(Entries, entry, node, hash) {
+		if (entry->hash == hash && !strcmp(entry->key, key)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+
+}
+
+/*
+ * What a line does to its key.
  *
- * Implementation
- * --------------
+ * 	PROC_SET - "key value", store value
+ * 	PROC_ADD - "key add n", "key inc" or "key dec", add to the value
+ * 	PROC_CAS - "key cas old new", store new if the value is old
  *
- * 1. Check the requested position and the length of buffer
- * 2. Read info from ubuf
- * 3. Return the new position
+ * A key which does not exist yet counts as 0.
  *
  */
-static ssize_t proc_write(struct file *file, const char __user *ubuf,
-	size_t count, loff_t *ppos) {
+enum proc_op {
+	PROC_SET,
+	PROC_ADD,
+	PROC_CAS,
+};
 
-	printk(KERN_DEBUG "proc_write for /proc/%s was triggered\n", PROCFS_NAME);
+/*
+ * A line written by the user, parsed.
+ *
+ * Description
+ * -----------
+ *
+ * 	hash      - hash of key
+ * 	key       - name of the integer
+ * 	op        - what to do with value
+ * 	value     - the value to store, or to add
+ * 	old       - the value PROC_CAS expects
+ * 	entry     - the entry of key in the store, NULL while it is not there
+ * 	new_entry - entry inserted in the store if the key was not found
+ *
+ */
+struct proc_update {
 
-	/*
-	 * Buffer used for copying data from user space.
-	 *
-	 */
-	char buf[BUFLEN];
+	u32 hash;
+	char key[KEY_LEN];
+	enum proc_op op;
+	s64 value;
+	s64 old;
+	struct proc_entry *entry;
+	struct proc_entry *new_entry;
 
-	/*
-	 * integer_no_read - number of parsed integers from ubuf
-	 * from_user	   - temporary variable used to store the integer from user
-	 * new_ppos        - length of buffer read from user
-	 *
-	 */
-	int integer_no_read = 0;
-	int from_user = 0;
-	int new_ppos = 0;
+};
+
+/*
+ * All the lines of a write. They are parsed first and applied together
+ * by batch_apply, so a write of thousands of lines takes the RCU read
+ * lock once and Entries_Lock at most once.
+ *
+ */
+struct proc_batch {
+
+	struct proc_update *updates;
+	size_t count;
+	size_t capacity;
+
+};
+
+/*
+ * Room for one more update at the end of the batch, or NULL if there is
+ * no memory for it.
+ *
+ */
+static struct proc_update *batch_next(struct proc_batch *batch) {
+
+	struct proc_update *updates;
+	size_t capacity;
+
+	if (batch->count == batch->capacity) {
+
+		capacity = max_t(size_t, 2 * batch->capacity, BATCH_MIN);
+
+		updates = kvmalloc_array(capacity, sizeof(*updates), GFP_KERNEL);
+		if (!updates) {
+			return NULL;
+		}
+
+		if (batch->count) {
+			memcpy(updates, batch->updates, batch->count * sizeof(*updates));
+		}
+
+		kvfree(batch->updates);
+		batch->updates = updates;
+		batch->capacity = capacity;
+
+	}
+
+	return &batch->updates[batch->count++];
+
+}
+
+/*
+ * Apply an update to an entry with a single atomic operation. Returns
+ * -EAGAIN if a compare and swap found another value.
+ *
+ */
+static int update_apply(struct proc_entry *entry,
+	const struct proc_update *update) {
+
+	switch (update->op) {
+
+		case PROC_ADD:
+			atomic64_add(update->value, &entry->value);
+			return SUCCESS;
+
+		case PROC_CAS:
+			if (atomic64_cmpxchg(&entry->value, update->old,
+				update->value) != update->old) {
+				return -EAGAIN;
+			}
+			return SUCCESS;
+
+		default:
+			atomic64_set(&entry->value, update->value);
+			return SUCCESS;
+
+	}
+
+}
+
+/*
+ * Tell the readers of the binary proc file that the values changed. The
+ * barrier orders the updates of the batch before the new sequence, so a
+ * reader that sees the new sequence sees the new values too.
+ *
+ */
+static void bump_sequence(const struct proc_batch *batch) {
+
+	if (batch->count) {
+		smp_mb__before_atomic();
+		atomic64_inc(&Sequence);
+	}
+
+}
+
+/*
+ * Is the key of update i, which is not in the store, also the key of an
+ * earlier update of the batch which is not in the store? Called with
+ * Entries_Lock held.
+ *
+ */
+static bool update_repeated(const struct proc_batch *batch, size_t i) {
+
+	const struct proc_update *update = &batch->updates[i];
+	size_t j;
+
+	for (j = 0; j < i; j++) {
+		if (!batch->updates[j].entry &&
+			batch->updates[j].hash == update->hash &&
+			!strcmp(batch->updates[j].key, update->key)) {
+			return true;
+		}
+	}
+
+	return false;
+
+}
+
+/*
+ * Apply all the updates of the batch to the store, in order, or none of
+ * them.
+ *
+ * When all the keys already exist only RCU is needed: the updates are
+ * atomic, so concurrent writers never lose an increment. Otherwise the
+ * new keys get their entries allocated without any lock held, and the
+ * room for them is checked before anything is applied. Then the whole
+ * batch is applied during a single hold of Entries_Lock, so an update of
+ * a new key is not overtaken by the updates after it.
+ *
+ * A compare and swap must be the only line of its write, otherwise the
+ * batch is refused with -EINVAL: when it fails the write returns -EAGAIN,
+ * and a client retrying the write must not apply other lines twice. So a
+ * failed compare and swap leaves the store and Sequence unchanged, and it
+ * does not create a new key.
+ *
+ */
+static int batch_apply(struct proc_batch *batch) {
+
+	struct proc_update *update;
+	struct proc_entry *entry;
+	size_t missing = 0;
+	size_t added = 0;
+	size_t i;
+	int ret_val = SUCCESS;
+	int cas_failed = SUCCESS;
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->updates[i].op == PROC_CAS && batch->count > 1) {
+			return -EINVAL;
+		}
+	}
+
+	rcu_read_lock();
+
+	for (i = 0; i < batch->count; i++) {
+
+		update = &batch->updates[i];
+		update->entry = entry_lookup(update->key, update->hash);
+
+		if (!update->entry) {
+			missing++;
+		}
+
+	}
+
+	if (!missing) {
+
+		for (i = 0; i < batch->count; i++) {
+			update = &batch->updates[i];
+			if (update_apply(update->entry, update) < 0) {
+				cas_failed = -EAGAIN;
+			}
+		}
+
+		rcu_read_unlock();
+
+		if (cas_failed) {
+			return cas_failed;
+		}
+
+		bump_sequence(batch);
+		return SUCCESS;
+
+	}
+
+	rcu_read_unlock();
+
+	for (i = 0; i < batch->count; i++) {
+
+		update = &batch->updates[i];
+		if (update->entry) {
+			continue;
+		}
+
+		update->new_entry = kmalloc(sizeof(*update->new_entry), GFP_KERNEL);
+		if (!update->new_entry) {
+			ret_val = -ENOMEM;
+			goto out;
+		}
+
+		update->new_entry->hash = update->hash;
+		strscpy(update->new_entry->key, update->key, KEY_LEN);
+		atomic64_set(&update->new_entry->value, 0);
 
-	/*
-	 * check if it is the first time we call read (*ppos = 0) and the user
-	 * buffer size is at least buflen large.
-	 *
-	 */
-	if (*ppos > 0 || count > BUFLEN) {
-		return -EFAULT;
 	}
 
 	/*
-	 * copy_from_user returns the number of bytes that could not be copied.
-	 * On success it returns 0.
+	 * Somebody may have added some of the keys since the lookups above,
+	 * look again under the lock. Entries are only removed when the module
+	 * is unloaded, so the ones found before are still there.
 	 *
 	 */
-	if (copy_from_user(buf, ubuf, count)) {
-		return -EFAULT;
+
+	spin_lock(&Entries_Lock);
+
+	for (i = 0; i < batch->count; i++) {
+
+		update = &batch->updates[i];
+		if (!update->entry) {
+			update->entry = entry_lookup(update->key, update->hash);
+		}
+
 	}
 
 	/*
-	 * Read the integer.
+	 * Count the keys the batch adds, a key written twice counts once. The
+	 * quadratic count is only needed when the store is close to full.
 	 *
 	 */
-	integer_no_read = sscanf(buf, "%d", &from_user);
-	if (integer_no_read != 1) {
-		return -EFAULT;
+
+	for (i = 0; i < batch->count; i++) {
+		if (!batch->updates[i].entry) {
+			added++;
+		}
+	}
+
+	if (Nr_Entries + added > MAX_ENTRIES) {
+
+		for (i = 0, added = 0; i < batch->count; i++) {
+			if (!batch->updates[i].entry && !update_repeated(batch, i)) {
+				added++;
+			}
+		}
+
+		if (Nr_Entries + added > MAX_ENTRIES) {
+			spin_unlock(&Entries_Lock);
+			ret_val = -ENOSPC;
+			goto out;
+		}
+
 	}
 
-	integer_from_user = from_user;
+	for (i = 0; i < batch->count; i++) {
+
+		update = &batch->updates[i];
+
+		/*
+		 * An earlier update of the batch may have added the key.
+		 *
+		 */
 
+		entry = update->entry;
+		if (!entry) {
+			entry = entry_lookup(update->key, update->hash);
+		}
+
+		if (entry) {
+			if (update_apply(entry, update) < 0) {
+				cas_failed = -EAGAIN;
+			}
+		} else if (update_apply(update->new_entry, update) < 0) {
+			cas_failed = -EAGAIN;
+		} else {
+			hash_add_rcu(Entries, &update->new_entry->node, update->hash);
+			Nr_Entries++;
+			update->new_entry = NULL;
+		}
+
+	}
+
+	spin_unlock(&Entries_Lock);
+
+	if (!cas_failed) {
+		bump_sequence(batch);
+	}
+
+out:
 	/*
-	 * Update the position.
+	 * Free the entries which were not inserted.
 	 *
 	 */
-	new_ppos = strlen(buf);
-	*ppos = new_ppos;
+	for (i = 0; i < batch->count; i++) {
+		kfree(batch->updates[i].new_entry);
+	}
 
-	return new_ppos;
+	return ret_val < 0 ? ret_val : cas_failed;
+
+}
+
+/*
+ * The next word of *cursor, or NULL if there are no more.
+ *
+ */
+static char *next_token(char **cursor) {
+
+	if (!*cursor) {
+		return NULL;
+	}
+
+	*cursor = skip_spaces(*cursor);
+	if (!**cursor) {
+		return NULL;
+	}
+
+	return strsep(cursor, " \t");
+
+}
+
+/*
+ * Parse a number with kstrtos64, which fails unless the whole word is a
+ * number.
+ *
+ */
+static int parse_value(const char *token, s64 *value) {
+
+	if (!token) {
+		return -EINVAL;
+	}
+
+	return kstrtos64(token, 0, value);
+
+}
+
+/*
+ * Parse one line written by the user and add it to the batch. Empty lines
+ * are ignored. The line is one of
+ *
+ * 	value                 store value in DEFAULT_KEY
+ * 	key value             store value in key
+ * 	key inc, key dec      add 1 or -1 to key
+ * 	key add n             add n to key
+ * 	key cas old new       store new in key if key is old
+ *
+ */
+static int parse_line(char *line, struct proc_batch *batch) {
+
+	struct proc_update *update;
+	char *key;
+	char *command;
+	enum proc_op op = PROC_SET;
+	s64 value = 1;
+	s64 old = 0;
+	int ret_val = SUCCESS;
+
+	line = strim(line);
+
+	key = next_token(&line);
+	if (!key) {
+		return SUCCESS;
+	}
+
+	command = next_token(&line);
+
+	if (!command) {
+		ret_val = parse_value(key, &value);
+		key = DEFAULT_KEY;
+	} else if (!strcmp(command, "inc")) {
+		op = PROC_ADD;
+	} else if (!strcmp(command, "dec")) {
+		op = PROC_ADD;
+		value = -1;
+	} else if (!strcmp(command, "add")) {
+		op = PROC_ADD;
+		ret_val = parse_value(next_token(&line), &value);
+	} else if (!strcmp(command, "cas")) {
+		op = PROC_CAS;
+		ret_val = parse_value(next_token(&line), &old);
+		if (ret_val == SUCCESS) {
+			ret_val = parse_value(next_token(&line), &value);
+		}
+	} else {
+		ret_val = parse_value(command, &value);
+	}
+
+	if (ret_val < 0) {
+		return ret_val;
+	}
+
+	if (strlen(key) >= KEY_LEN || next_token(&line)) {
+		return -EINVAL;
+	}
+
+	update = batch_next(batch);
+	if (!update) {
+		return -ENOMEM;
+	}
+
+	strscpy(update->key, key, KEY_LEN);
+	update->hash = full_name_hash(NULL, update->key, strlen(update->key));
+	update->op = op;
+	update->value = value;
+	update->old = old;
+	update->new_entry = NULL;
+
+	return SUCCESS;
+
+}
+
+/*
+ * Parse the complete lines among the length bytes of buf, until the batch
+ * holds BATCH_MAX updates. *parsed is set to the number of bytes of the
+ * lines parsed, the rest of buf is a line cut by the end of the chunk.
+ *
+ */
+static int parse_chunk(char *buf, size_t length, struct proc_batch *batch,
+	size_t *parsed) {
+
+	char *line = buf;
+	char *end = buf + length;
+	char *newline;
+	int ret_val;
+
+	while (batch->count < BATCH_MAX &&
+		(newline = memchr(line, '\n', end - line))) {
+
+		*newline = 0;
+
+		/*
+		 * A NUL byte inside the line would hide the rest of it.
+		 *
+		 */
+		if (strlen(line) != newline - line) {
+			return -EINVAL;
+		}
+
+		ret_val = parse_line(line, batch);
+		if (ret_val < 0) {
+			return ret_val;
+		}
+
+		line = newline + 1;
+
+	}
+
+	*parsed = line - buf;
+
+	return SUCCESS;
 
 }
 
@@ -120,56 +632,270 @@ static ssize_t proc_write(struct file *file, const char __user *ubuf,
  * Implementation
  * --------------
  *
- * 1. Check the requested position
- * 2. Fill the buffer with data from the requested position
- * (be careful not to overflow)
- * 3. Return the number of filled bytes
+ * 1. Copy ubuf CHUNK_SIZE bytes at a time and parse its lines
+ * 2. Parse what follows the last newline as the last line
+ * 3. Apply all the lines at once
+ * 4. Return the number of bytes used
+ *
+ * A write can be as large as needed. A line cut at the end of a chunk is
+ * completed by the next chunk, but every write holds whole lines: what
+ * follows the last newline is the last line, as with
+ * 'echo -n 5 > /proc/helloworld'. If a line is wrong nothing of the write
+ * is applied.
+ *
+ * A write stops after BATCH_MAX lines, which bounds the memory a batch
+ * takes, and returns the number of bytes of those lines. Programs like
+ * cat write the rest again, as for any short write.
+ *
+ * ex: printf 'cpu 3\nmemory 70\n' > /proc/helloworld
  *
  */
-
-static ssize_t proc_read(struct file *file, char __user *ubuf, size_t count,
-	loff_t *ppos) {
-
-	char buf[BUFLEN];
-	int  write_bytes = 0;
-
-	printk(KERN_DEBUG "proc_read for /proc/%s was triggered\n", PROCFS_NAME);
+static ssize_t proc_write(struct file *file, const char __user *ubuf,
+	size_t count, loff_t *ppos) {
 
 	/*
-	 * check if it is the first time we call read (*ppos = 0) and the user
-	 * buffer size is at least buflen large.
+	 * batch   - the lines parsed so far
+	 * buf     - the line cut by the last chunk followed by a new chunk
+	 * partial - bytes of that cut line at the start of buf
+	 * copied  - bytes of ubuf copied so far
+	 * done    - bytes of ubuf in the lines parsed so far
+	 * chunk   - bytes of ubuf copied in this round
+	 * parsed  - bytes of buf parsed in this round
 	 *
 	 */
+	struct proc_batch batch = { 0 };
+	char *buf;
+	size_t partial = 0;
+	size_t copied = 0;
+	size_t done = 0;
+	size_t chunk;
+	size_t parsed;
+	int ret_val = SUCCESS;
 
-	if (*ppos > 0 || count < BUFLEN) {
-		return 0;
+	printk(KERN_DEBUG "proc_write for /proc/%s was triggered\n", PROCFS_NAME);
+
+	buf = kmalloc(LINE_LEN + CHUNK_SIZE, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
 	}
 
-	/*
-	 * Fill the local buffer and keep track of how many bytes were written.
-	 *
-	 */
+	while (copied < count) {
+
+		chunk = min_t(size_t, count - copied, CHUNK_SIZE);
+
+		/*
+		 * copy_from_user returns the number of bytes that could not be
+		 * copied. On success it returns 0.
+		 *
+		 */
+		if (copy_from_user(buf + partial, ubuf + copied, chunk)) {
+			ret_val = -EFAULT;
+			break;
+		}
+
+		copied += chunk;
+
+		ret_val = parse_chunk(buf, partial + chunk, &batch, &parsed);
+		if (ret_val < 0) {
+			break;
+		}
 
-	write_bytes += sprintf(buf, "The integer keept in kernel space is: %d\n", 
-		integer_from_user);
+		done += parsed;
+		partial = partial + chunk - parsed;
+
+		if (batch.count == BATCH_MAX) {
+			break;
+		}
+
+		if (partial >= LINE_LEN) {
+			ret_val = -EINVAL;
+			break;
+		}
+
+		memmove(buf, buf + parsed, partial);
+
+	}
 
 	/*
-	 * Use copy_to_user for safe transfer to user space.
+	 * The bytes after the last newline are the last line of the write.
 	 *
 	 */
 
-	if (copy_to_user(ubuf, buf, write_bytes)) {
-		return -EFAULT;
+	if (ret_val == SUCCESS && batch.count < BATCH_MAX && partial) {
+
+		buf[partial] = 0;
+
+		if (strlen(buf) != partial) {
+			ret_val = -EINVAL;
+		} else {
+			ret_val = parse_line(buf, &batch);
+			done += partial;
+		}
+
+	}
+
+	if (ret_val == SUCCESS) {
+		ret_val = batch_apply(&batch);
+	}
+
+	kvfree(batch.updates);
+	kfree(buf);
+
+	if (ret_val < 0) {
+		return ret_val;
 	}
 
 	/*
-	 * Update offset and return the written bytes.
+	 * Update the position.
 	 *
 	 */
+	*ppos += done;
+
+	return done;
+
+}
+
+/*
+ * The first entry in a bucket starting with bucket bkt, or NULL past the
+ * last one. Called under rcu_read_lock.
+ *
+ */
+static struct proc_entry *entry_first_from(unsigned int bkt) {
 
-	*ppos = write_bytes;
+	struct proc_entry *entry;
 
-	return write_bytes;
+	for (; bkt < HASH_SIZE(Entries); bkt++) {
+		hlist_for_each_entry_rcu(entry, &Entries[bkt], node) {
+			return entry;
+		}
+	}
+
+	return NULL;
+
+}
+
+/*
+ * The entry after entry, following its bucket and then the next buckets.
+ * Called under rcu_read_lock.
+ *
+ */
+static struct proc_entry *entry_next(struct proc_entry *entry) {
+
+	struct hlist_node *node = rcu_dereference(hlist_next_rcu(&entry->node));
+
+	if (node) {
+		return hlist_entry(node, struct proc_entry, node);
+	}
+
+	return entry_first_from(hash_min(entry->hash, HASH_BITS(Entries)) + 1);
+
+}
+
+/*
+ * The read side is a seq_file iterator: seq_read calls proc_seq_start,
+ * then proc_seq_show and proc_seq_next for as many entries as fit in its
+ * page, then proc_seq_stop, and starts again at *pos for the next page. So
+ * the table can have any length and every user buffer size works.
+ *
+ * A key added during a read may or may not be listed.
+ *
+ */
+static void *proc_seq_start(struct seq_file *m, loff_t *pos) {
+
+	struct proc_entry *entry;
+	loff_t i;
+
+	printk(KERN_DEBUG "proc_read for /proc/%s was triggered\n", PROCFS_NAME);
+
+	rcu_read_lock();
+
+	entry = entry_first_from(0);
+	for (i = 0; entry && i < *pos; i++) {
+		entry = entry_next(entry);
+	}
+
+	return entry;
+
+}
+
+static void *proc_seq_next(struct seq_file *m, void *v, loff_t *pos) {
+
+	(*pos)++;
+
+	return entry_next(v);
+
+}
+
+static void proc_seq_stop(struct seq_file *m, void *v) {
+
+	rcu_read_unlock();
+
+}
+
+/*
+ * Print one entry, in the format proc_write accepts.
+ *
+ */
+static int proc_seq_show(struct seq_file *m, void *v) {
+
+	struct proc_entry *entry = v;
+
+	seq_printf(m, "%s %lld\n", entry->key, atomic64_read(&entry->value));
+
+	return SUCCESS;
+
+}
+
+static const struct seq_operations proc_seq_ops = {
+	.start = proc_seq_start,
+	.next  = proc_seq_next,
+	.stop  = proc_seq_stop,
+	.show  = proc_seq_show
+};
+
+/*
+ * Attach a seq_file walking the table to the open file.
+ *
+ */
+static int proc_open(struct inode *inode, struct file *file) {
+
+	return seq_open(file, &proc_seq_ops);
+
+}
+
+/*
+ * Read of the binary proc file: a struct procfs1_raw copied with a single
+ * copy_to_user. There is nothing to format and no lookup, so a monitoring
+ * process can poll it at a high rate.
+ *
+ * The whole record is read at offset 0 or nothing is read: asking for less
+ * than the record is an error, reading past it gives EOF.
+ *
+ */
+static ssize_t proc_raw_read(struct file *file, char __user *ubuf,
+	size_t count, loff_t *ppos) {
+
+	struct procfs1_raw raw;
+
+	if (*ppos > 0) {
+		return 0;
+	}
+
+	if (count < sizeof(raw)) {
+		return -EINVAL;
+	}
+
+	raw.sequence = atomic64_read(&Sequence);
+	smp_rmb();
+	raw.value = atomic64_read(&Default_Entry->value);
+
+	if (copy_to_user(ubuf, &raw, sizeof(raw))) {
+		return -EFAULT;
+	}
+
+	*ppos = sizeof(raw);
+
+	return sizeof(raw);
 
 }
 
@@ -178,9 +904,18 @@ static ssize_t proc_read(struct file *file, char __user *ubuf, size_t count,
  *
  */
 static const struct file_operations proc_file_fops = {
-	.owner = THIS_MODULE,
-	.read  = proc_read,
-	.write = proc_write
+	.owner   = THIS_MODULE,
+	.open    = proc_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+	.write   = proc_write
+};
+
+static const struct file_operations proc_raw_fops = {
+	.owner  = THIS_MODULE,
+	.read   = proc_raw_read,
+	.llseek = default_llseek
 };
 
 int init_module() {
@@ -199,9 +934,30 @@ int init_module() {
 	 * be created
 	 *
 	 */
+	Default_Entry = kzalloc(sizeof(*Default_Entry), GFP_KERNEL);
+	if (!Default_Entry) {
+		return -ENOMEM;
+	}
+
+	strscpy(Default_Entry->key, DEFAULT_KEY, KEY_LEN);
+	Default_Entry->hash = full_name_hash(NULL, DEFAULT_KEY,
+		strlen(DEFAULT_KEY));
+	hash_add_rcu(Entries, &Default_Entry->node, Default_Entry->hash);
+	Nr_Entries = 1;
+
 	Proc_File = proc_create(PROCFS_NAME, PERMS, NULL, &proc_file_fops);
 
 	if (Proc_File == 0) {
+		kfree(Default_Entry);
+		return -EPERM;
+	}
+
+	Proc_Raw_File = proc_create(PROCFS_RAW_NAME, RAW_PERMS, NULL,
+		&proc_raw_fops);
+
+	if (Proc_Raw_File == 0) {
+		proc_remove(Proc_File);
+		kfree(Default_Entry);
 		return -EPERM;
 	}
 
@@ -213,12 +969,25 @@ int init_module() {
 
 void cleanup_module() {
 
+	struct proc_entry *entry;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
 	/*
-	 * Remove the proc created in init_module.
+	 * Remove the procs created in init_module.
 	 *
 	 */
+	proc_remove(Proc_Raw_File);
 	proc_remove(Proc_File);
 
+	/*
+	 * Nobody can read the table anymore, free the entries.
+	 *
+	 */
+	hash_for_each_safe(Entries, bkt, tmp, entry, node) {
+		kfree(entry);
+	}
+
 	printk(KERN_DEBUG "/proc/helloworld was removed!\n");
 }
 
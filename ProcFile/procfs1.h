@@ -0,0 +1,42 @@
+#ifndef PROCFS1_H_
+#define PROCFS1_H_
+
+/*
+ * This file is shared between the kernel module and the user space
+ * programs which read the binary proc file.
+ *
+ */
+
+/*
+ * The binary proc file. Reading it gives the value of the "integer" key of
+ * /proc/helloworld as a struct procfs1_raw, with no text to format or to
+ * parse.
+ *
+ * Read it with pread at offset 0, so that the same open file can be read
+ * again and again:
+ *
+ * 	struct procfs1_raw raw;
+ * 	pread(fd, &raw, sizeof(raw), 0);
+ *
+ */
+#define PROCFS_RAW_NAME "helloworld_raw"
+#define PROCFS_RAW_PATH "/proc/" PROCFS_RAW_NAME
+
+/*
+ * Description
+ * -----------
+ *
+ * 	sequence - number of writes applied to /proc/helloworld so far, it
+ * 	           changes whenever a write may have changed the value
+ * 	value    - the value of the "integer" key, at least as recent as
+ * 	           sequence
+ *
+ */
+struct procfs1_raw {
+
+	unsigned long long sequence;
+	long long value;
+
+};
+
+#endif
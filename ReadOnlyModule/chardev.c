@@ -1,7 +1,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h>
+#include <linux/atomic.h>
+#include <linux/uaccess.h>
 
 #include "chardev.h"
 
@@ -17,12 +18,17 @@
  */
 
 static int Major;		// major number assigned to the device driver
-static int Device_Open = 0;	// is the device open? used to prevent multiple access to device
 
-static char msg_buffer[BUFLEN];	// the message the device will give when asked
-static char * msg_pointer;
+/*
+ * Number of times the device greeted somebody. It is atomic so that any
+ * number of processes can open the device at the same time, each one
+ * getting its own value, without a lock.
+ *
+ */
+static atomic64_t Counter = ATOMIC64_INIT(0);
 
 static struct file_operations fops = {
+	.llseek  = device_llseek,
 	.read    = device_read,
 	.write   = device_write,
 	.open 	 = device_open,
@@ -66,24 +72,34 @@ void cleanup_module(void) {
  *
  */
 
+/*
+ * Write the message of the open that got the given value of the counter
+ * in msg_buffer, which must be BUFLEN bytes long, and return its length.
+ *
+ * The message is never stored: it is short, so it is cheaper to render it
+ * again for every read than to allocate a buffer for every open.
+ *
+ */
+static size_t render_message(unsigned long ticket, char *msg_buffer) {
+
+	return scnprintf(msg_buffer, BUFLEN, "I told you %lu times Hello World!\n",
+		ticket);
+
+}
+
 /*
  * Called when a process tries to open the device.
  * ex: 'cat /dev/chardev'
  *
+ * The device can be opened by many processes at once. Every open takes
+ * the next value of the counter and keeps it in file->private_data, which
+ * is all the state a reader needs.
+ *
  */
 static int device_open(struct inode * inode, struct file * file) {
 
-	static int counter = 0;
-
-	// if the device is already open then restrict access
-	if (Device_Open) {
-		return -EBUSY;
-	}
-	Device_Open = 1;
-
-	// take a pointer to msg in msg_pointer
-	sprintf(msg_buffer, "I told you %d times Hello World!\n", counter++);
-	msg_pointer = msg_buffer;
+	file->private_data = (void *) (unsigned long)
+		atomic64_fetch_inc(&Counter);
 
 	// increment the use count
 	try_module_get(THIS_MODULE);
@@ -98,9 +114,6 @@ static int device_open(struct inode * inode, struct file * file) {
  */
 static int device_release(struct inode * inode, struct file * file) {
 
-	// make the device available
-	Device_Open = 0;
-
 	/*
 	 * Decrement the usage count, or else once this file is opened,
 	 * kernel won't be able to get rid of this module.
@@ -112,51 +125,65 @@ static int device_release(struct inode * inode, struct file * file) {
 
 }
 
+/*
+ * Called when a process moves in the file with lseek.
+ *
+ * The file is as long as the message, so SEEK_END works too. Seeking back
+ * to 0 lets a process read the message again without opening the device
+ * again.
+ *
+ */
+static loff_t device_llseek(struct file * filp, loff_t offset, int whence) {
+
+	char msg_buffer[BUFLEN];
+
+	return fixed_size_llseek(filp, offset, whence,
+		render_message((unsigned long) filp->private_data, msg_buffer));
+
+}
+
 /*
  * Called when a proces reads data from device.
  *
+ * *offset is the position of the read in the message, so read, pread and
+ * lseek all work, and several threads can pread the same file at once.
+ *
  */
 static ssize_t device_read(struct file * filp, char * buffer, size_t length,
 	loff_t * offset) {
 
-	/*
-	 * Number of bytes written to buffer.
-	 *
-	 */
-	int bytes_write = 0;
+	char msg_buffer[BUFLEN];
+	size_t msg_length;
+
+	msg_length = render_message((unsigned long) filp->private_data,
+		msg_buffer);
 
 	/*
-	 * If msg_pointer is 0 it means that we got to EOF.
+	 * If the whole message was read it means that we got to EOF.
 	 *
 	 */
-	if (*msg_pointer == 0) {
+	if (*offset >= msg_length) {
 		return SUCCESS;
 	}
 
+	length = min_t(size_t, length, msg_length - *offset);
+
 	/*
-	 * Put the data into the buffer.
+	 * The buffer is in user data segment, not in kernel segment.
+	 * copy_to_user copies the whole piece of the message at once.
 	 *
 	 */
-	while (length && *msg_pointer) {
-		/*
-		 * The buffer is in user data segment, not in kernel segment.
-		 * put_user will copy data from kernel data segment to
-		 * user data segment. This works only for simple values like
-		 * int, char ..
-		 *
-		 */
-
-		put_user(*(msg_pointer++), buffer++);
-		
-		length--;
-		bytes_write++;
+	if (copy_to_user(buffer, msg_buffer + *offset, length)) {
+		return -EFAULT;
 	}
 
+	*offset += length;
+
 	/*
 	 * Return the number of bytes put into the buffer.
 	 *
 	 */
-	return bytes_write;
+	return length;
 
 }
 